@@ -41,6 +41,7 @@ main(int argc, char **argv)
 	struct xcbft_patterns_holder font_patterns;
 	struct utf_holder text;
 	struct xcbft_face_holder faces;
+	struct xcbft_context *ctx;
 
 	// let's draw a simple rectangle on the window
 	xcb_rectangle_t rectangles[] = {
@@ -65,6 +66,19 @@ main(int argc, char **argv)
 	text_color.alpha = 0xFFFF;
 
 	xcbft_init();
+	// with -c, the rasters of the last runs shared with the other
+	// processes, kept in the cache directory of the user
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		xcbft_disk_cache_open(NULL);
+	}
+	// everything xcbft needs from the connection, queried once
+	ctx = xcbft_context_create(c);
+	if (ctx == NULL) {
+		puts("could not create the xcbft context");
+		xcbft_done();
+		xcb_disconnect(c);
+		return 1;
+	}
     char *searchlist = "times:style=bold:pixelsize=20,monospace:pixelsize=20\n";
 	fontsearch = xcbft_extract_fontsearch_list(searchlist);
 	// test fallback support also
@@ -72,17 +86,16 @@ main(int argc, char **argv)
 	text = char_to_uint32("Héllo World");
 	font_patterns = xcbft_query_fontsearch_all(fontsearch);
 
-	long dpi = xcbft_get_dpi(c);
+	double pix_size = xcbft_get_pixel_size(font_patterns);
+	faces = xcbft_load_faces(ctx, font_patterns);
+
 	xcb_render_color_t back_color = { .red = 0x90FF, .green = 0x90FF, .blue = 0x90FF };
-	xcb_pixmap_t pipixamap = xcbft_create_text_pixmap(c, text,
+	xcb_pixmap_t pipixamap = xcbft_create_text_pixmap(ctx, text,
 		text_color,
 		back_color,
-		font_patterns, dpi);
+		faces);
 	xcb_rectangle_t p_size = get_drawable_size(c, pipixamap);
 
-	double pix_size = xcbft_get_pixel_size(font_patterns);
-	faces = xcbft_load_faces(font_patterns, dpi);
-
 	FcStrSetDestroy(fontsearch);
 	xcbft_patterns_holder_destroy(font_patterns);
 
@@ -135,13 +148,12 @@ main(int argc, char **argv)
 
 
 	FT_Vector advance = xcbft_draw_text(
-		c,
+		ctx,
 		pmap, // win or pixmap
 		50, 60, // x, y
 		text, // text
 		text_color,
-		faces,
-		dpi);
+		faces);
 	printf("advance: %ld\n", advance.x);
 	// draw a rectangle at that place to know the advance was
 	// calculated properly
@@ -240,6 +252,15 @@ goto endloop;
 			}
 		}
 		case 0:
+			// the errors of the text drawing come back here too
+			if (xcbft_handle_error(ctx, err)) {
+				xcb_generic_error_t xcbft_err;
+				while (xcbft_next_error(ctx, &xcbft_err)) {
+					printf("Received xcbft error %d\n",
+						xcbft_err.error_code);
+				}
+				break;
+			}
 			printf("Received X11 error %d\n", err->error_code);
 		}
 		free(e);
@@ -248,14 +269,19 @@ endloop:
 	puts("end");
         if (e) free(e);
 
+	xcbft_invalidate_drawable(ctx, pmap);
 	xcb_free_pixmap(c, pmap);
-	xcb_free_pixmap(c, pipixamap);
+	xcbft_release_text_pixmap(ctx, pipixamap);
 	xcb_free_gc(c, gc);
-	xcb_disconnect(c);
 	// XXX: DEBUG
 
 	utf_holder_destroy(text);
-	xcbft_face_holder_destroy(faces);
+	// the faces go before the context that loaded them
+	xcbft_face_holder_destroy(ctx, faces);
+	xcbft_context_destroy(ctx);
+	// the formats reply cached by renderutil, left alone by xcbft
+	xcb_render_util_disconnect(c);
+	xcb_disconnect(c);
 	xcbft_done();
 	return 0;
 }
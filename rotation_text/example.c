@@ -50,6 +50,7 @@ main(int argc, char **argv)
 	struct xcbft_patterns_holder font_patterns;
 	struct utf_holder text;
 	struct xcbft_face_holder faces;
+	struct xcbft_context *ctx;
 
 	// let's draw a simple rectangle on the window
 	xcb_rectangle_t rectangles[] = {
@@ -68,14 +69,21 @@ main(int argc, char **argv)
 	}
 
 	xcbft_init();
+	// everything xcbft needs from the connection, queried once
+	ctx = xcbft_context_create(c);
+	if (ctx == NULL) {
+		puts("could not create the xcbft context");
+		xcbft_done();
+		xcb_disconnect(c);
+		return 1;
+	}
     char *searchlist = "times:style=bold:pixelsize=30,monospace:pixelsize=40\n";
 	fontsearch = xcbft_extract_fontsearch_list(searchlist);
 	// test fallback support also
 	text = char_to_uint32("Héllo ༃𐤋𐤊탄ཀ𐍊");
 	font_patterns = xcbft_query_fontsearch_all(fontsearch);
 	FcStrSetDestroy(fontsearch);
-	long dpi = xcbft_get_dpi(c);
-	faces = xcbft_load_faces(font_patterns, dpi);
+	faces = xcbft_load_faces(ctx, font_patterns);
 	xcbft_patterns_holder_destroy(font_patterns);
 
 	// XXX: DEBUG
@@ -131,13 +139,12 @@ main(int argc, char **argv)
 	text_color.alpha = 0xFFFF;
 
 	FT_Vector advance = xcbft_draw_text(
-		c,
+		ctx,
 		pmap, // win or pixmap
 		50, 60, // x, y
 		text, // text
 		text_color,
-		faces,
-		dpi);
+		faces);
 	printf("advance: %ld\n", advance.x);
 	// draw a rectangle at that place to know the advance was
 	// calculated properly
@@ -268,13 +275,18 @@ endloop:
 	puts("end");
         if (e) free(e);
 
+	xcbft_invalidate_drawable(ctx, pmap);
 	xcb_free_pixmap(c, pmap);
 	xcb_free_gc(c, gc);
-	xcb_disconnect(c);
 	// XXX: DEBUG
 
 	utf_holder_destroy(text);
-	xcbft_face_holder_destroy(faces);
+	// the faces go before the context that loaded them
+	xcbft_face_holder_destroy(ctx, faces);
+	xcbft_context_destroy(ctx);
+	// the formats reply cached by renderutil, left alone by xcbft
+	xcb_render_util_disconnect(c);
+	xcb_disconnect(c);
 	xcbft_done();
 	return 0;
 }
@@ -7,10 +7,22 @@
 #include <stdint.h>
 #include <errno.h>
 #include <math.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <fontconfig/fontconfig.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_SIZES_H
+#include FT_OUTLINE_H
 
 #include <xcb/xcb.h>
 #include <xcb/render.h>
@@ -24,14 +36,659 @@ struct xcbft_patterns_holder {
 	uint8_t length;
 };
 
+// a font file mapped once for the whole process, the faces of all the
+// contexts and workers are created on it
+struct xcbft_font_file {
+	char *path;
+	const FT_Byte *data;
+	size_t size;
+	// number of faces using it
+	unsigned int refcount;
+};
+
+// the workers open faces too
+struct xcbft_font_files {
+	pthread_mutex_t lock;
+	struct xcbft_font_file **files;
+	unsigned int length;
+};
+
+static struct xcbft_font_files xcbft_font_files = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// a font file opened once per context and shared by all its sizes
+struct xcbft_face_entry {
+	char *file;
+	int index;
+	FT_Face face;
+	struct xcbft_font_file *mapping;
+	// number of xcbft_font using it
+	unsigned int refcount;
+};
+
+// in pixels, as the glyph would be rasterized
+struct xcbft_glyph_metrics {
+	int16_t x_advance;
+	int16_t y_advance;
+	// ink box relative to the origin, y going up
+	int16_t x_min;
+	int16_t y_min;
+	int16_t x_max;
+	int16_t y_max;
+	bool loaded;
+};
+
+// a face at a given size and transformation, the glyphs are rasterized
+// from it after activating its size
+struct xcbft_font {
+	struct xcbft_face_entry *entry;
+	FT_Face face;
+	FT_Size size;
+	// height in 26.6 points, at the dpi of the context
+	FT_F26Dot6 char_size;
+	bool has_matrix;
+	FT_Matrix matrix;
+	// from the render settings, the glyphs and their metrics are loaded
+	// with them
+	FT_Int32 load_flags;
+	// pages of 256 glyphs measured by xcbft_text_extents, allocated when
+	// first used
+	struct xcbft_glyph_metrics **metrics;
+	unsigned int refcount;
+};
+
+#define XCBFT_COVERAGE_PAGES (0x110000 >> 8)
+
+// where a codepoint was found, the face being an index in the holder
+// followed by the fallbacks of the coverage
+struct xcbft_coverage_slot {
+	uint32_t glyph_index;
+	// 0 when not looked up yet, the index of the face + 1 otherwise
+	uint16_t face;
+};
+
+// codepoint to (face, glyph index) of a holder, filled as the codepoints
+// are drawn
+struct xcbft_coverage {
+	// ASCII and Latin-1 without going through the pages
+	struct xcbft_coverage_slot latin1[256];
+	// the rest in pages of 256 codepoints, allocated when first used
+	struct xcbft_coverage_slot *pages[XCBFT_COVERAGE_PAGES];
+	struct xcbft_font **fallbacks;
+	unsigned int fallbacks_length;
+	// size, weight and slant of the first face for the fallback queries
+	FcPattern *style;
+};
+
+// a face of a holder that isn't opened yet, the charset of its pattern
+// tells whether it is worth opening for a codepoint
+struct xcbft_face_ref {
+	char *file;
+	int index;
+	FT_F26Dot6 char_size;
+	bool has_matrix;
+	FT_Matrix matrix;
+	FT_Int32 load_flags;
+	// NULL if the pattern has none, the face is then opened to know
+	FcCharSet *charset;
+	// it couldn't be opened, not tried again
+	bool failed;
+};
+
+// the fonts are shared between the holders through the context
 struct xcbft_face_holder {
-	FT_Face *faces;
+	// the first one is always opened, the others can be NULL until
+	// needed, their references are then in refs
+	struct xcbft_font **faces;
 	uint8_t length;
+	struct xcbft_coverage *coverage;
+	struct xcbft_face_ref *refs;
+};
+
+// codepoint to the face resolved for it when no face of the holder had it,
+// a NULL face records that none supports it
+struct xcbft_fallback_map {
+	uint32_t *codepoints;
+	struct xcbft_face_entry **entries;
+	uint8_t *used;
+	unsigned int length;
+	unsigned int allocated;
+};
+
+struct xcbft_face_cache {
+	struct xcbft_face_entry **entries;
+	unsigned int entries_length;
+	struct xcbft_font **fonts;
+	unsigned int fonts_length;
+	// fonts loaded for unsupported characters, one reference each kept
+	// until the context is destroyed
+	struct xcbft_font **fallbacks;
+	unsigned int fallbacks_length;
+	// so that fontconfig is asked at most once per codepoint
+	struct xcbft_fallback_map resolved;
+};
+
+// how the glyphs are rasterized, turned into the load flags of the fonts
+// which are part of the glyph cache key
+struct xcbft_render_settings {
+	bool antialias;
+	bool hinting;
+	// FC_HINT_NONE to FC_HINT_FULL
+	int hint_style;
+	// the autohinter instead of the hinting of the font
+	bool autohint;
+	// in pixels, the fonts at least this big aren't hinted, 0 to hint
+	// all of them
+	double unhinted_size;
+};
+
+// the hint style when neither the resources nor the configuration of
+// fontconfig say, fontconfig's own default being full
+#define XCBFT_DEFAULT_HINT_STYLE FC_HINT_SLIGHT
+
+// the settings given by the resources, they win over the font patterns,
+// even the rules of fontconfig for a font that Xft would let win
+#define XCBFT_SETTING_ANTIALIAS (1 << 0)
+#define XCBFT_SETTING_HINTING (1 << 1)
+#define XCBFT_SETTING_HINT_STYLE (1 << 2)
+#define XCBFT_SETTING_AUTOHINT (1 << 3)
+#define XCBFT_SETTING_ALL 0xf
+
+// the ids of a glyphset stay under this so that a text of a single
+// glyphset never needs more than 16 bits per glyph
+#define XCBFT_GLYPHSET_IDS 65536
+
+// a glyph of a font uploaded in one of the shared glyphsets
+struct xcbft_glyph {
+	// kept so that the advance can be reused
+	xcb_render_glyphinfo_t info;
+	// dense id in the glyphset, the first ones given fit in 8 bits
+	uint32_t id;
+	// index of the glyphset in the glyph cache
+	unsigned int set;
+};
+
+// set of the glyphs of a font already uploaded, open addressing on the
+// glyph index of the font
+struct xcbft_glyph_table {
+	uint32_t *indexes;
+	struct xcbft_glyph *glyphs;
+	uint8_t *used;
+	unsigned int length;
+	unsigned int allocated;
+};
+
+// glyphs staged for upload to a glyphset, sent together in as few
+// AddGlyphs requests as the maximum request length allows
+struct xcbft_glyph_batch {
+	uint32_t *ids;
+	xcb_render_glyphinfo_t *infos;
+	unsigned int length;
+	unsigned int allocated;
+	// the bitmaps one after the other, rows padded to 4 bytes
+	uint8_t *data;
+	size_t data_length;
+	size_t data_allocated;
+};
+
+// a server-side glyphset holding the glyphs of all the fonts, they get the
+// smallest ids available so that the texts go in 8 or 16 bits streams
+struct xcbft_glyphset {
+	xcb_render_glyphset_t glyphset;
+	// the ids under it were given, the freed ones are used first
+	uint32_t next_id;
+	uint32_t *free_ids;
+	unsigned int free_length;
+	unsigned int free_allocated;
+	struct xcbft_glyph_batch batch;
+};
+
+// the glyphs of a (font, load flags) in the glyphsets, the font being a
+// face at a size
+struct xcbft_font_glyphs {
+	struct xcbft_font *font;
+	FT_Int32 load_flags;
+	// id of the font and flags in the raster cache and their key in the
+	// disk cache
+	uint32_t raster_font;
+	uint64_t disk_key;
+	struct xcbft_glyph_table glyphs;
+};
+
+// the rasterized glyphs are kept for the whole process up to this many
+// bytes, so that a new glyphset, context or connection gets them without
+// going through FreeType
+#define XCBFT_RASTER_CACHE_LIMIT (4*1024*1024)
+
+// what the glyphs are rasterized from, the same for the fonts of all the
+// contexts that have the face at the same scale
+struct xcbft_raster_font {
+	char *file;
+	int index;
+	// 16.16, from the size and the dpi
+	FT_Fixed x_scale;
+	FT_Fixed y_scale;
+	bool has_matrix;
+	FT_Matrix matrix;
+	FT_Int32 load_flags;
+	// the same with the identity of the file, for the disk cache
+	uint64_t disk_key;
+};
+
+struct xcbft_raster {
+	uint32_t font;
+	uint32_t glyph_index;
+	xcb_render_glyphinfo_t info;
+	// rows padded to 4 bytes as AddGlyphs wants them, allocated along
+	// with the raster
+	uint8_t *data;
+	size_t size;
+	// put there by the workers or from the disk for the upload that
+	// follows, already counted so finding it then isn't a hit
+	bool counted;
+	// next in the bucket
+	struct xcbft_raster *next;
+	// in the order they were used
+	struct xcbft_raster *newer;
+	struct xcbft_raster *older;
+};
+
+struct xcbft_raster_cache_stats {
+	// glyphs found in the cache, read from the disk cache and rasterized
+	unsigned long hits;
+	unsigned long disk_hits;
+	unsigned long misses;
+	unsigned long evictions;
+	// bytes taken by the rasters kept and their number
+	size_t size;
+	unsigned int length;
+};
+
+// the least recently used rasters are dropped when over the limit
+struct xcbft_raster_cache {
+	// the contexts using it can be on different threads
+	pthread_mutex_t lock;
+	struct xcbft_raster_font *fonts;
+	unsigned int fonts_length;
+	// chained on (font, glyph index)
+	struct xcbft_raster **buckets;
+	unsigned int buckets_length;
+	struct xcbft_raster *newest;
+	struct xcbft_raster *oldest;
+	size_t limit;
+	struct xcbft_raster_cache_stats stats;
+};
+
+static struct xcbft_raster_cache xcbft_rasters = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.limit = XCBFT_RASTER_CACHE_LIMIT
+};
+
+// the rasters can also be kept in a file shared by all the processes,
+// mapped read-only and appended to under an exclusive lock
+#define XCBFT_DISK_CACHE_MAGIC 0x31435258
+#define XCBFT_DISK_CACHE_LIMIT (64*1024*1024)
+#define XCBFT_DISK_CACHE_HEADER "xcbftrc1"
+// the default file goes with the version of the header so that another
+// version of the library doesn't touch it
+#define XCBFT_DISK_CACHE_NAME "rasters-1"
+
+// followed by the bitmap, rows padded to 4 bytes
+struct xcbft_disk_record {
+	uint32_t magic;
+	uint32_t glyph_index;
+	uint64_t font;
+	xcb_render_glyphinfo_t info;
+	uint32_t size;
+};
+
+struct xcbft_disk_cache {
+	// flock only keeps the other processes out
+	pthread_mutex_t lock;
+	int fd;
+	const uint8_t *map;
+	size_t mapped;
+	// the records are indexed up to there
+	size_t indexed;
+	// (font, glyph index) to the offset of its record, 0 when empty,
+	// open addressing
+	uint64_t *fonts;
+	uint32_t *glyphs;
+	uint64_t *offsets;
+	unsigned int length;
+	unsigned int allocated;
+	// records rasterized here, appended by the next flush
+	uint8_t *pending;
+	size_t pending_length;
+	size_t pending_allocated;
+};
+
+static struct xcbft_disk_cache xcbft_disk = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1
+};
+
+// the glyphs missing from a draw are rasterized by the workers when there
+// are at least this many of them
+#define XCBFT_PARALLEL_GLYPHS 16
+
+// a glyph to rasterize on a worker, with what it needs to set up its own
+// face the same way as the font
+struct xcbft_raster_job {
+	const char *file;
+	int index;
+	FT_F26Dot6 char_size;
+	long dpi;
+	bool has_matrix;
+	FT_Matrix matrix;
+	FT_Int32 load_flags;
+	uint32_t raster_font;
+	uint64_t disk_key;
+	uint32_t glyph_index;
+	// the result, NULL if the face couldn't be opened
+	struct xcbft_raster *raster;
+	// for the upload of prewarmed glyphs, a reference is held on it until
+	// then, the workers don't touch it
+	struct xcbft_font *font;
+};
+
+// FreeType faces aren't thread-safe, every worker opens the faces again
+// in its own library, on the mappings shared with the contexts
+struct xcbft_worker_face {
+	struct xcbft_font_file *file;
+	int index;
+	FT_Face face;
+};
+
+struct xcbft_worker_font {
+	FT_Face face;
+	FT_Size size;
+	FT_F26Dot6 char_size;
+	long dpi;
+};
+
+struct xcbft_worker {
+	pthread_t thread;
+	struct xcbft_worker_pool *pool;
+	FT_Library library;
+	struct xcbft_worker_face *faces;
+	unsigned int faces_length;
+	struct xcbft_worker_font *fonts;
+	unsigned int fonts_length;
+};
+
+// threads rasterizing the jobs of a draw while the thread of the
+// connection waits, it uploads the rasters afterwards
+struct xcbft_worker_pool {
+	pthread_mutex_t lock;
+	// signaled when there are jobs or it's time to quit
+	pthread_cond_t work;
+	// signaled when the last job is done
+	pthread_cond_t done;
+	struct xcbft_raster_job *jobs;
+	unsigned int jobs_length;
+	unsigned int next_job;
+	unsigned int pending;
+	// the jobs are from xcbft_prewarm, collected by the next draw
+	bool background;
+	bool quit;
+	struct xcbft_worker *workers;
+	unsigned int length;
+};
+
+// errors of the requests sent without waiting for them, they come back
+// through the event queue of the application which hands them over with
+// xcbft_handle_error
+#define XCBFT_ERROR_QUEUE_LENGTH 16
+
+typedef void (*xcbft_error_handler_t)(xcb_generic_error_t *, void *);
+
+struct xcbft_error_queue {
+	xcb_generic_error_t errors[XCBFT_ERROR_QUEUE_LENGTH];
+	unsigned int first;
+	unsigned int length;
+	// errors lost because the queue was full
+	unsigned int dropped;
+	// if set the errors are given to it instead of being queued
+	xcbft_error_handler_t handler;
+	void *handler_data;
+};
+
+// long-lived cache of glyphs, the entries are keyed on the font and
+// dropped when the font is released
+struct xcbft_glyph_cache {
+	xcb_connection_t *c;
+	xcb_render_pictformat_t format;
+	// in bytes, from xcb_get_maximum_request_length
+	size_t max_request_length;
+	struct xcbft_font_glyphs *entries;
+	unsigned int length;
+	unsigned int allocated;
+	// a new one is created when all the ids of the others are taken
+	struct xcbft_glyphset *sets;
+	unsigned int sets_length;
+};
+
+// solid fill pictures of the colors drawn most recently, the least
+// recently used one is replaced when they are all taken
+#define XCBFT_PEN_CACHE_LENGTH 16
+
+struct xcbft_pen {
+	xcb_render_color_t color;
+	xcb_render_picture_t picture;
+	unsigned long last_used;
+};
+
+struct xcbft_pen_cache {
+	struct xcbft_pen pens[XCBFT_PEN_CACHE_LENGTH];
+	unsigned int length;
+	unsigned long clock;
+};
+
+// picture created on a drawable the first time it is drawn on, kept until
+// the drawable is invalidated
+struct xcbft_drawable_picture {
+	xcb_drawable_t drawable;
+	xcb_render_picture_t picture;
+};
+
+struct xcbft_picture_cache {
+	struct xcbft_drawable_picture *pictures;
+	unsigned int length;
+	unsigned int allocated;
+};
+
+// pixmaps of xcbft_create_text_pixmap given back to be used again for
+// texts of the same size, the ones lent are also followed to know their size
+#define XCBFT_PIXMAP_POOL_LENGTH 16
+
+struct xcbft_pooled_pixmap {
+	xcb_pixmap_t pixmap;
+	uint16_t width;
+	uint16_t height;
+	uint8_t depth;
+	bool in_use;
+};
+
+struct xcbft_pixmap_pool {
+	struct xcbft_pooled_pixmap pixmaps[XCBFT_PIXMAP_POOL_LENGTH];
+	unsigned int length;
+};
+
+// a font list parsed, matched and loaded once, shared by everyone asking
+// for the same list
+struct xcbft_font_spec {
+	// the list with the blanks around the entries removed
+	char *query;
+	struct xcbft_patterns_holder patterns;
+	struct xcbft_face_holder faces;
+	// one is held by the cache as long as the configuration stays the same
+	unsigned int refcount;
+};
+
+struct xcbft_spec_cache {
+	// the specs were matched with it, they are dropped when it changes,
+	// referenced so that a new one can't take its address
+	FcConfig *config;
+	struct xcbft_font_spec **specs;
+	unsigned int length;
+};
+
+// the render format of a visual of one of the screens
+struct xcbft_visual_format {
+	xcb_visualid_t visual;
+	uint8_t depth;
+	xcb_render_pictformat_t format;
+};
+
+// state kept for the whole life of a connection, created once and given to
+// all the drawing functions so that they don't have to query anything
+struct xcbft_context {
+	xcb_connection_t *c;
+	long dpi;
+	// the defaults of the render settings, and which of them are forced
+	// on all the fonts
+	struct xcbft_render_settings settings;
+	unsigned int settings_forced;
 	FT_Library library;
+	xcb_render_pictformat_t format_a8;
+	xcb_render_pictformat_t format_argb32;
+	xcb_render_pictformat_t format_rgb24;
+	struct xcbft_visual_format *visual_formats;
+	unsigned int visual_formats_length;
+	// in bytes, from xcb_get_maximum_request_length
+	size_t max_request_length;
+	// to recognize the errors of render requests
+	uint8_t render_opcode;
+	struct xcbft_error_queue errors;
+	// flush after every draw, otherwise it's left to the application
+	bool auto_flush;
+	struct xcbft_glyph_cache *glyph_cache;
+	struct xcbft_face_cache faces;
+	struct xcbft_spec_cache specs;
+	struct xcbft_pen_cache pens;
+	struct xcbft_picture_cache pictures;
+	struct xcbft_pixmap_pool pixmap_pool;
+	// NULL unless xcbft_set_workers was called
+	struct xcbft_worker_pool *workers;
+	// a bit per codepoint drawn, NULL unless recording
+	uint8_t *usage;
+};
+
+// codepoints from first to last included
+struct xcbft_codepoint_range {
+	uint32_t first;
+	uint32_t last;
+};
+
+struct xcbft_text_extents {
+	// where the text that follows would start, from the origin
+	FT_Vector advance;
+	// smallest box holding the ink, from the origin with y going down as
+	// in X, empty when nothing is drawn
+	int16_t x;
+	int16_t y;
+	uint16_t width;
+	uint16_t height;
+	// the largest of the faces used, in pixels above and below the
+	// baseline
+	int16_t ascent;
+	int16_t descent;
+};
+
+// a text to draw at a position with xcbft_draw_runs
+struct xcbft_text_run {
+	int16_t x;
+	int16_t y;
+	struct utf_holder text;
+	struct xcbft_face_holder faces;
+	xcb_render_color_t color;
+	// set by the draw, where the text that follows would start
+	FT_Vector advance;
+};
+
+// a cell of a grid, a space or 0 only shows the background
+struct xcbft_grid_cell {
+	uint32_t codepoint;
+	xcb_render_color_t fg;
+	xcb_render_color_t bg;
+};
+
+// the codepoint of the cells shown whose content isn't known
+#define XCBFT_GRID_UNKNOWN UINT32_MAX
+
+// cells of the same size drawn with a monospace face, only the rows or
+// spans that changed since the last render are drawn again
+struct xcbft_grid {
+	struct xcbft_context *ctx;
+	xcb_drawable_t drawable;
+	xcb_render_picture_t picture;
+	// for the scrolling copies
+	xcb_gcontext_t gc;
+	struct xcbft_face_holder faces;
+	int16_t x;
+	int16_t y;
+	uint16_t columns;
+	uint16_t rows;
+	// from the advance of 'M' and the height of the faces
+	uint16_t cell_width;
+	uint16_t cell_height;
+	int16_t ascent;
+	xcb_render_color_t fg;
+	xcb_render_color_t bg;
+	// what should be shown and what the drawable has, by rows
+	struct xcbft_grid_cell *cells;
+	struct xcbft_grid_cell *shown;
+	// columns [first, last) of every row that may have changed
+	uint16_t *dirty_first;
+	uint16_t *dirty_last;
+	// room for the codepoints of the runs of a render
+	uint32_t *codepoints;
+	struct xcbft_text_run *runs;
+	xcb_rectangle_t *rectangles;
+	xcb_render_color_t *rectangle_colors;
+};
+
+#define XCBFT_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define XCBFT_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// where a character of a text slot was drawn, from the origin of the slot
+struct xcbft_slot_glyph {
+	int pen;
+	// the box of its ink, the same as the pen when there is none
+	int left;
+	int right;
+	int top;
+	int bottom;
+};
+
+// a text drawn again and again at the same place, only the characters
+// that changed since the last time are cleared and drawn
+struct xcbft_text_slot {
+	struct xcbft_context *ctx;
+	xcb_render_picture_t picture;
+	int16_t x;
+	int16_t y;
+	struct xcbft_face_holder faces;
+	xcb_render_color_t fg;
+	xcb_render_color_t bg;
+	// what is on the drawable
+	bool drawn;
+	uint32_t *text;
+	struct xcbft_slot_glyph *glyphs;
+	unsigned int length;
+	unsigned int allocated;
+	FT_Vector advance;
 };
 
 struct xcbft_glyphset_and_advance {
-	xcb_render_glyphset_t glyphset;
+	// the glyphset of every character of the text, to be freed
+	xcb_render_glyphset_t *glyphsets;
+	// the glyph of every character in its glyphset, to be freed
+	uint32_t *glyphs;
+	// the largest of the glyphs, to know how many bits they need
+	uint32_t max_glyph;
 	FT_Vector advance;
 };
 
@@ -39,33 +696,201 @@ struct xcbft_glyphset_and_advance {
 bool xcbft_init(void);
 void xcbft_done(void);
 FcPattern* xcbft_query_fontsearch(FcChar8 *);
-struct xcbft_face_holder xcbft_query_by_char_support(
-		FcChar32, const FcPattern *, long);
+struct xcbft_context *xcbft_context_create(xcb_connection_t *);
+void xcbft_context_destroy(struct xcbft_context *);
+xcb_render_pictformat_t xcbft_format_for_visual(struct xcbft_context *,
+	xcb_visualid_t);
+xcb_render_pictformat_t xcbft_format_for_depth(struct xcbft_context *,
+	uint8_t);
+struct xcbft_face_holder xcbft_query_by_char_support(struct xcbft_context *,
+		FcChar32, const FcPattern *);
 struct xcbft_patterns_holder xcbft_query_fontsearch_all(FcStrSet *);
 double xcbft_get_pixel_size(struct xcbft_patterns_holder patterns);
-struct xcbft_face_holder xcbft_load_faces(
-	struct xcbft_patterns_holder, long);
+struct xcbft_face_holder xcbft_load_faces(struct xcbft_context *,
+	struct xcbft_patterns_holder);
+struct xcbft_font *xcbft_font_get(struct xcbft_context *, const char *, int,
+	FT_F26Dot6, const FT_Matrix *, FT_Int32);
+void xcbft_font_release(struct xcbft_context *, struct xcbft_font *);
+static FT_Error xcbft_face_open(FT_Library, const char *, int, FT_Face *,
+	struct xcbft_font_file **);
+static struct xcbft_font_file *xcbft_font_file_open(const char *);
+static void xcbft_font_file_release(struct xcbft_font_file *);
+void xcbft_font_activate(struct xcbft_font *);
 FcStrSet* xcbft_extract_fontsearch_list(char *);
 void xcbft_patterns_holder_destroy(struct xcbft_patterns_holder);
-void xcbft_face_holder_destroy(struct xcbft_face_holder);
-FT_Vector xcbft_draw_text(xcb_connection_t*, xcb_drawable_t,
+struct xcbft_font_spec *xcbft_font_spec_get(struct xcbft_context *,
+	const char *);
+void xcbft_font_spec_release(struct xcbft_context *,
+	struct xcbft_font_spec *);
+void xcbft_face_holder_destroy(struct xcbft_context *,
+	struct xcbft_face_holder);
+FT_Vector xcbft_draw_text(struct xcbft_context *, xcb_drawable_t,
 	int16_t, int16_t, struct utf_holder, xcb_render_color_t,
-	struct xcbft_face_holder, long);
-xcb_render_picture_t xcbft_create_pen(xcb_connection_t*,
+	struct xcbft_face_holder);
+FT_Vector xcbft_draw_text_picture(struct xcbft_context *,
+	xcb_render_picture_t, int16_t, int16_t, struct utf_holder,
+	xcb_render_color_t, struct xcbft_face_holder);
+void xcbft_draw_runs(struct xcbft_context *, xcb_drawable_t,
+	struct xcbft_text_run *, unsigned int);
+void xcbft_draw_runs_picture(struct xcbft_context *, xcb_render_picture_t,
+	struct xcbft_text_run *, unsigned int);
+struct xcbft_grid *xcbft_grid_create(struct xcbft_context *, xcb_drawable_t,
+	struct xcbft_face_holder, int16_t, int16_t, uint16_t, uint16_t,
+	xcb_render_color_t, xcb_render_color_t);
+void xcbft_grid_destroy(struct xcbft_grid *);
+void xcbft_grid_set(struct xcbft_grid *, uint16_t, uint16_t, uint32_t,
+	xcb_render_color_t, xcb_render_color_t);
+void xcbft_grid_set_text(struct xcbft_grid *, uint16_t, uint16_t,
+	struct utf_holder, xcb_render_color_t, xcb_render_color_t);
+void xcbft_grid_scroll(struct xcbft_grid *, int);
+void xcbft_grid_render(struct xcbft_grid *);
+void xcbft_grid_invalidate(struct xcbft_grid *);
+struct xcbft_text_slot *xcbft_text_slot_create(struct xcbft_context *,
+	xcb_drawable_t, struct xcbft_face_holder, int16_t, int16_t,
+	xcb_render_color_t, xcb_render_color_t);
+FT_Vector xcbft_text_slot_update(struct xcbft_text_slot *, struct utf_holder);
+void xcbft_text_slot_invalidate(struct xcbft_text_slot *);
+void xcbft_text_slot_destroy(struct xcbft_text_slot *);
+xcb_render_picture_t xcbft_get_picture(struct xcbft_context *,
+	xcb_drawable_t);
+void xcbft_invalidate_drawable(struct xcbft_context *, xcb_drawable_t);
+xcb_render_picture_t xcbft_create_pen(struct xcbft_context *,
+		xcb_render_color_t);
+xcb_render_picture_t xcbft_get_pen(struct xcbft_context *,
 		xcb_render_color_t);
-struct xcbft_glyphset_and_advance xcbft_load_glyphset(xcb_connection_t *,
-	struct xcbft_face_holder, struct utf_holder, long);
-FT_Vector xcbft_load_glyph(xcb_connection_t *, xcb_render_glyphset_t,
-	FT_Face, int);
+struct xcbft_glyph_cache *xcbft_glyph_cache_create(struct xcbft_context *);
+void xcbft_glyph_cache_destroy(struct xcbft_glyph_cache *);
+struct xcbft_font_glyphs *xcbft_glyph_cache_get_font(
+	struct xcbft_glyph_cache *, struct xcbft_font *, FT_Int32);
+struct xcbft_glyphset_and_advance xcbft_load_glyphset(
+	struct xcbft_context *, struct xcbft_face_holder,
+	struct utf_holder);
+const struct xcbft_glyph *xcbft_load_glyph(struct xcbft_glyph_cache *,
+	struct xcbft_font_glyphs *, uint32_t);
+void xcbft_glyph_cache_upload(struct xcbft_glyph_cache *);
+void xcbft_set_auto_flush(struct xcbft_context *, bool);
+void xcbft_set_error_handler(struct xcbft_context *,
+	xcbft_error_handler_t, void *);
+bool xcbft_handle_error(struct xcbft_context *, xcb_generic_error_t *);
+bool xcbft_next_error(struct xcbft_context *, xcb_generic_error_t *);
 long xcbft_get_dpi(xcb_connection_t *);
-xcb_pixmap_t xcbft_create_text_pixmap(xcb_connection_t *,
+static long xcbft_resources_dpi(xcb_connection_t *, xcb_xrm_database_t *);
+static unsigned int xcbft_resources_settings(xcb_xrm_database_t *,
+	struct xcbft_render_settings *);
+void xcbft_set_render_settings(struct xcbft_context *,
+	struct xcbft_render_settings);
+static struct xcbft_render_settings xcbft_pattern_settings(
+	struct xcbft_context *, FcPattern *);
+static void xcbft_pattern_default_hint_style(FcPattern *);
+static FT_Int32 xcbft_load_flags(struct xcbft_render_settings, double);
+struct xcbft_text_extents xcbft_text_extents(struct xcbft_context *,
+	struct xcbft_face_holder, struct utf_holder);
+xcb_pixmap_t xcbft_create_text_pixmap(struct xcbft_context *,
 	struct utf_holder, xcb_render_color_t, xcb_render_color_t,
-	struct xcbft_patterns_holder, long);
-static uint32_t xcb_color_to_uint32(xcb_render_color_t);
+	struct xcbft_face_holder);
+void xcbft_release_text_pixmap(struct xcbft_context *, xcb_pixmap_t);
+static struct xcbft_glyph *xcbft_glyph_table_get(
+	struct xcbft_glyph_table *, uint32_t);
+static void xcbft_glyph_table_put(struct xcbft_glyph_table *, uint32_t,
+	struct xcbft_glyph);
+static void xcbft_glyph_table_destroy(struct xcbft_glyph_table *);
+static void xcbft_glyph_cache_forget_font(struct xcbft_glyph_cache *,
+	struct xcbft_font *);
+static uint32_t xcbft_raster_font_id(struct xcbft_font *, FT_Int32,
+	uint64_t *);
+static unsigned int xcbft_raster_bucket(uint32_t, uint32_t, unsigned int);
+static const struct xcbft_raster *xcbft_raster_get(
+	struct xcbft_font_glyphs *, uint32_t);
+static void xcbft_raster_touch(struct xcbft_raster *);
+static struct xcbft_raster *xcbft_raster_find(uint32_t, uint32_t);
+static struct xcbft_raster *xcbft_raster_new(FT_GlyphSlot, uint32_t,
+	uint32_t);
+static void xcbft_raster_insert(struct xcbft_raster *);
+static void xcbft_raster_cache_trim(void);
+bool xcbft_disk_cache_open(const char *);
+void xcbft_disk_cache_close(void);
+static int xcbft_disk_cache_replace(const char *, int);
+static uint64_t xcbft_disk_key(const struct xcbft_raster_font *);
+static size_t xcbft_disk_cache_sync(void);
+static bool xcbft_disk_record_valid(const struct xcbft_disk_record *,
+	size_t, size_t);
+static void xcbft_disk_cache_index(uint64_t, uint32_t, uint64_t);
+static uint64_t xcbft_disk_cache_find(uint64_t, uint32_t);
+static struct xcbft_raster *xcbft_disk_cache_get(uint64_t, uint32_t,
+	uint32_t);
+static void xcbft_disk_cache_put(uint64_t, const struct xcbft_raster *);
+static void xcbft_disk_cache_flush(void);
+bool xcbft_set_workers(struct xcbft_context *, unsigned int);
+static void xcbft_worker_pool_stop(struct xcbft_worker_pool *);
+static void *xcbft_worker_run(void *);
+static void xcbft_worker_rasterize(struct xcbft_worker *,
+	struct xcbft_raster_job *);
+static unsigned int xcbft_raster_jobs(struct xcbft_context *,
+	struct xcbft_font **, const uint32_t *, unsigned int,
+	struct xcbft_raster_job *);
+static void xcbft_workers_start(struct xcbft_worker_pool *,
+	struct xcbft_raster_job *, unsigned int, bool);
+static void xcbft_workers_wait(struct xcbft_worker_pool *);
+static void xcbft_rasterize_parallel(struct xcbft_context *,
+	struct xcbft_font **, const uint32_t *, unsigned int);
+void xcbft_prewarm(struct xcbft_context *, struct xcbft_face_holder,
+	const struct xcbft_codepoint_range *, unsigned int);
+static void xcbft_prewarm_collect(struct xcbft_context *);
+void xcbft_record_usage(struct xcbft_context *, bool);
+bool xcbft_save_usage(struct xcbft_context *, const char *);
+unsigned int xcbft_load_usage(const char *, struct xcbft_codepoint_range **);
+static void xcbft_repack_rows(uint8_t *, size_t, const FT_Bitmap *);
+static void xcbft_expand_mono_rows(uint8_t *, size_t, const FT_Bitmap *);
+static void xcbft_raster_cache_clear(void);
+void xcbft_raster_cache_set_limit(size_t);
+struct xcbft_raster_cache_stats xcbft_raster_cache_stats(void);
+static struct xcbft_font *xcbft_get_fallback(struct xcbft_context *,
+	FcChar32, struct xcbft_face_holder);
+static void xcbft_resolve_fallbacks(struct xcbft_context *,
+	struct xcbft_face_holder, const uint32_t *, unsigned int);
+static struct xcbft_font *xcbft_fallback_font(struct xcbft_context *,
+	const char *, int, FT_F26Dot6, FT_Int32);
+static bool xcbft_fallback_map_get(struct xcbft_fallback_map *, uint32_t,
+	struct xcbft_face_entry **);
+static void xcbft_fallback_map_put(struct xcbft_fallback_map *, uint32_t,
+	struct xcbft_face_entry *);
+static void xcbft_fallback_map_destroy(struct xcbft_fallback_map *);
+static struct xcbft_font *xcbft_holder_font(struct xcbft_context *,
+	struct xcbft_face_holder, unsigned int);
+static uint32_t xcbft_holder_char_index(struct xcbft_context *,
+	struct xcbft_face_holder, unsigned int, uint32_t);
+static struct xcbft_coverage_slot *xcbft_coverage_slot(
+	struct xcbft_face_holder, uint32_t, struct xcbft_coverage_slot *);
+static struct xcbft_font *xcbft_coverage_lookup(struct xcbft_context *,
+	struct xcbft_face_holder, uint32_t, uint32_t *);
+static void xcbft_coverage_prepare(struct xcbft_context *,
+	struct xcbft_face_holder, struct utf_holder);
+static void xcbft_coverage_destroy(struct xcbft_coverage *);
+static struct xcbft_glyph_metrics *xcbft_font_metrics(struct xcbft_font *,
+	uint32_t);
+static void xcbft_glyph_batch_send(struct xcbft_glyph_cache *,
+	struct xcbft_glyphset *);
+static unsigned int xcbft_glyph_cache_new_id(struct xcbft_glyph_cache *,
+	uint32_t *);
+static void xcbft_glyph_batch_destroy(struct xcbft_glyph_batch *);
+static void xcbft_grid_free_arrays(struct xcbft_grid *);
+static void xcbft_grid_damage(struct xcbft_grid *, uint16_t, uint16_t,
+	uint16_t);
+static FT_Vector xcbft_text_slot_layout(struct xcbft_context *,
+	struct xcbft_face_holder, struct utf_holder, struct xcbft_slot_glyph *);
+static struct xcbft_glyphset_and_advance xcbft_stage_glyphset(
+	struct xcbft_context *, struct xcbft_face_holder, struct utf_holder);
+static char *xcbft_normalize_fontsearch(const char *);
+static void xcbft_spec_cache_clear(struct xcbft_context *);
+static xcb_render_picture_t xcbft_add_picture(struct xcbft_context *,
+	xcb_drawable_t, xcb_render_pictformat_t);
+static void xcbft_pixmap_pool_forget(struct xcbft_context *, xcb_pixmap_t);
 
 void
 xcbft_done(void)
 {
+	xcbft_disk_cache_close();
+	xcbft_raster_cache_clear();
 	FcFini();
 }
 
@@ -82,160 +907,575 @@ xcbft_init(void)
 	return status == FcTrue;
 }
 
-// Inspired by https://www.codeproject.com/Articles/1202772/Color-Topics-for-Programmers
-static uint32_t
-xcb_color_to_uint32(xcb_render_color_t rgb)
+/*
+ * Create the state used for all the drawing on the connection.
+ * The render formats, the maximum request length and the dpi are queried
+ * once here, nothing has to be asked to the server afterwards.
+ *
+ * The formats reply cached by xcb-renderutil is left alone, call
+ * xcb_render_util_disconnect before closing the connection to free it.
+ */
+struct xcbft_context *
+xcbft_context_create(xcb_connection_t *c)
 {
-	uint32_t sm1 = 65536 - 1; // from 2^16
-	uint32_t scale = 256; // to 2^8
-
-	return
-		  (uint32_t) ( ((double)rgb.red/sm1   * (scale-1)) * scale * scale)
-		+ (uint32_t) ( ((double)rgb.green/sm1 * (scale-1)) * scale)
-		+ (uint32_t) ( ((double)rgb.blue/sm1  * (scale-1)) );
-}
+	struct xcbft_context *ctx;
+	xcb_render_pictforminfo_t *fmt_a8, *fmt_argb32, *fmt_rgb24;
+	xcb_render_pictvisual_t *pict_visual;
+	xcb_screen_iterator_t screen_iter;
+	xcb_depth_iterator_t depth_iter;
+	xcb_visualtype_iterator_t visual_iter;
+	xcb_xrm_database_t *xrm_db;
+	FT_Error error;
+	const xcb_render_query_pict_formats_reply_t *fmt_rep =
+		xcb_render_util_query_formats(c);
 
-xcb_pixmap_t
-xcbft_create_text_pixmap(
-	xcb_connection_t *c,
-	struct utf_holder text,
-	xcb_render_color_t text_color,
-	xcb_render_color_t background_color,
-	struct xcbft_patterns_holder font_patterns,
-	long dpi)
-{
-	xcb_pixmap_t pmap, resize_pmap;
-	xcb_screen_t *screen;
-	screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
-	struct xcbft_face_holder faces;
-	double pix_size = 12;
-	uint32_t mask = 0;
-	uint32_t values[2];
-	xcb_gcontext_t gc;
-	
-	pix_size = xcbft_get_pixel_size(font_patterns);
-	pmap = xcb_generate_id(c);
-	faces = xcbft_load_faces(font_patterns, dpi);
+	if (fmt_rep == NULL) {
+		fprintf(stderr, "could not query the render formats\n");
+		return NULL;
+	}
 
-	// 0.2 being the factor padding on both side
-	// 0.3 being the extra factor padding for the width protection
-	uint16_t width = (pix_size*text.length/1.6)+pix_size*0.7;
-	uint16_t height = pix_size+pix_size*0.4;
+	fmt_a8 = xcb_render_util_find_standard_format(
+		fmt_rep, XCB_PICT_STANDARD_A_8);
+	fmt_argb32 = xcb_render_util_find_standard_format(
+		fmt_rep, XCB_PICT_STANDARD_ARGB_32);
+	fmt_rgb24 = xcb_render_util_find_standard_format(
+		fmt_rep, XCB_PICT_STANDARD_RGB_24);
+	if (fmt_a8 == NULL || fmt_argb32 == NULL || fmt_rgb24 == NULL) {
+		fprintf(stderr, "the standard render formats are missing\n");
+		return NULL;
+	}
 
-	xcb_create_pixmap(c, screen->root_depth, pmap, screen->root, width, height);
+	ctx = calloc(1, sizeof(struct xcbft_context));
+	if (ctx == NULL) {
+		perror(NULL);
+		return NULL;
+	}
 
-	xcb_rectangle_t rectangles[] = { { .x = 0, .y = 0,
-			.width = width, .height = height } };
-	gc = xcb_generate_id(c);
-	mask = XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES;
-	values[0] = xcb_color_to_uint32(background_color) | 0xff000000;
-	values[1] = 0;
-	xcb_create_gc(c, gc, pmap, mask, values);
-	// draw a rectangle filling the whole pixmap with a single color
-	xcb_poly_fill_rectangle(c, pmap, gc, 1, rectangles);
+	error = FT_Init_FreeType(&ctx->library);
+	if (error != FT_Err_Ok) {
+		fprintf(stderr, "could not initialize freetype\n");
+		free(ctx);
+		return NULL;
+	}
 
-	FT_Vector advance = xcbft_draw_text(c, pmap,
-		0.2*pix_size, 0.2*pix_size+pix_size, // x, y
-		text, text_color, faces, dpi);
+	ctx->c = c;
+	// hinted lightly with the font's own hinting unless told otherwise
+	ctx->settings.antialias = true;
+	ctx->settings.hinting = true;
+	ctx->settings.hint_style = XCBFT_DEFAULT_HINT_STYLE;
+	ctx->settings.autohint = false;
+	ctx->settings.unhinted_size = 0;
+	// the dpi and the settings with a single fetch of the resources
+	xrm_db = xcb_xrm_database_from_default(c);
+	if (xrm_db == NULL) {
+		fprintf(stderr,
+			"Could not open Xresources database falling back to highest dpi found\n");
+	}
+	ctx->dpi = xcbft_resources_dpi(c, xrm_db);
+	if (xrm_db != NULL) {
+		ctx->settings_forced = xcbft_resources_settings(xrm_db,
+			&ctx->settings);
+		xcb_xrm_database_free(xrm_db);
+	}
+	ctx->format_a8 = fmt_a8->id;
+	ctx->format_argb32 = fmt_argb32->id;
+	ctx->format_rgb24 = fmt_rgb24->id;
+	ctx->auto_flush = true;
+	// in 4 bytes units
+	ctx->max_request_length = xcb_get_maximum_request_length(c)*4;
+	// already queried by xcb when asking for the formats
+	ctx->render_opcode = xcb_get_extension_data(c,
+		&xcb_render_id)->major_opcode;
 
-	resize_pmap = xcb_generate_id(c);
-	width = advance.x+pix_size*0.4; // 0.2 on both sides
-	xcb_create_pixmap(c, screen->root_depth, resize_pmap, screen->root, width, height);
-	xcb_copy_area(c, pmap, resize_pmap, gc, 0, 0, 0, 0, width, height);
+	// resolve the format of every visual of every screen
+	screen_iter = xcb_setup_roots_iterator(xcb_get_setup(c));
+	for (; screen_iter.rem; xcb_screen_next(&screen_iter)) {
+		depth_iter = xcb_screen_allowed_depths_iterator(screen_iter.data);
+		for (; depth_iter.rem; xcb_depth_next(&depth_iter)) {
+			visual_iter = xcb_depth_visuals_iterator(depth_iter.data);
+			for (; visual_iter.rem; xcb_visualtype_next(&visual_iter)) {
+				pict_visual = xcb_render_util_find_visual_format(
+					fmt_rep, visual_iter.data->visual_id);
+				if (pict_visual == NULL) {
+					continue;
+				}
+				ctx->visual_formats = realloc(ctx->visual_formats,
+					sizeof(struct xcbft_visual_format) *
+					(ctx->visual_formats_length+1));
+				ctx->visual_formats[ctx->visual_formats_length] =
+					(struct xcbft_visual_format) {
+						.visual = visual_iter.data->visual_id,
+						.depth = depth_iter.data->depth,
+						.format = pict_visual->format
+					};
+				ctx->visual_formats_length++;
+			}
+		}
+	}
 
-	xcb_free_pixmap(c, pmap);
-	xcbft_face_holder_destroy(faces);
+	ctx->glyph_cache = xcbft_glyph_cache_create(ctx);
 
-	return resize_pmap;
+	return ctx;
 }
 
 /*
- * Do the font queries through fontconfig and return the info
- *
- * Assumes:
- *	Fontconfig is already init & cleaned outside
- *	the FcPattern return needs to be cleaned outside
+ * The faces loaded with the context have to be destroyed before it,
+ * the fallbacks it loaded itself are released here.
  */
-FcPattern*
-xcbft_query_fontsearch(FcChar8 *fontquery)
+void
+xcbft_context_destroy(struct xcbft_context *ctx)
 {
-	FcBool status;
-	FcPattern *fc_finding_pattern, *pat_output;
-	FcResult result;
-
-	fc_finding_pattern = FcNameParse(fontquery);
+	unsigned int i;
 
-	// to match we need to fix the pattern (fill unspecified info)
-	FcDefaultSubstitute(fc_finding_pattern);
-	status = FcConfigSubstitute(NULL, fc_finding_pattern, FcMatchPattern);
-	if (status == FcFalse) {
-		fprintf(stderr, "could not perform config font substitution");
-		return NULL;
+	if (ctx == NULL) {
+		return;
+	}
+	for (i = 0; i < ctx->pens.length; i++) {
+		xcb_render_free_picture(ctx->c, ctx->pens.pens[i].picture);
+	}
+	for (i = 0; i < ctx->pictures.length; i++) {
+		xcb_render_free_picture(ctx->c,
+			ctx->pictures.pictures[i].picture);
+	}
+	free(ctx->pictures.pictures);
+	for (i = 0; i < ctx->pixmap_pool.length; i++) {
+		if (!ctx->pixmap_pool.pixmaps[i].in_use) {
+			xcb_free_pixmap(ctx->c,
+				ctx->pixmap_pool.pixmaps[i].pixmap);
+		}
 	}
+	xcbft_set_workers(ctx, 0);
+	free(ctx->usage);
+	xcbft_spec_cache_clear(ctx);
+	for (i = 0; i < ctx->faces.fallbacks_length; i++) {
+		xcbft_font_release(ctx, ctx->faces.fallbacks[i]);
+	}
+	free(ctx->faces.fallbacks);
+	xcbft_fallback_map_destroy(&ctx->faces.resolved);
+	free(ctx->faces.fonts);
+	free(ctx->faces.entries);
+	xcbft_glyph_cache_destroy(ctx->glyph_cache);
+	free(ctx->visual_formats);
+	FT_Done_FreeType(ctx->library);
+	free(ctx);
+}
 
-	pat_output = FcFontMatch(NULL, fc_finding_pattern, &result);
+xcb_render_pictformat_t
+xcbft_format_for_visual(struct xcbft_context *ctx, xcb_visualid_t visual)
+{
+	unsigned int i;
 
-	FcPatternDestroy(fc_finding_pattern);
-	if (result == FcResultMatch) {
-		return pat_output;
-	} else if (result == FcResultNoMatch) {
-		fprintf(stderr, "there wasn't a match");
-	} else {
-		fprintf(stderr, "the match wasn't as good as it should be");
+	for (i = 0; i < ctx->visual_formats_length; i++) {
+		if (ctx->visual_formats[i].visual == visual) {
+			return ctx->visual_formats[i].format;
+		}
 	}
-	return NULL;
+	return XCB_NONE;
 }
 
 /*
- * Query a font based on character support
- * Optionally pass a pattern that it'll use as the base for the search
- *
- * fallback of font added to the list or somehow done when drawing,
- * to do that we need to search by the charset we want to draw
- * and if they are in one of the font already specified, thus need to
- * know what the users want to insert as text. This needs more thinking
- * to be decoupled.
+ * The format for a pixmap of that depth, pixmaps don't have visuals.
+ */
+xcb_render_pictformat_t
+xcbft_format_for_depth(struct xcbft_context *ctx, uint8_t depth)
+{
+	switch (depth) {
+	case 32:
+		return ctx->format_argb32;
+	case 24:
+		return ctx->format_rgb24;
+	case 8:
+		return ctx->format_a8;
+	}
+	return XCB_NONE;
+}
 
-	Assumes the ft2 library is already loaded
-	Assumes the face will be cleaned outside
+/*
+ * Measure the text as it would be drawn with the faces, without
+ * rasterizing it nor sending anything to the X server.
+ * The metrics of the glyphs are kept in the fonts for the next times.
  */
-struct xcbft_face_holder
-xcbft_query_by_char_support(FcChar32 character,
-		const FcPattern *copy_pattern, long dpi)
+struct xcbft_text_extents
+xcbft_text_extents(struct xcbft_context *ctx,
+	struct xcbft_face_holder faces, struct utf_holder text)
 {
-	FcBool status;
-	FcResult result;
-	FcCharSet *charset;
-	FcPattern *charset_pattern, *pat_output;
-	struct xcbft_patterns_holder patterns;
-	struct xcbft_face_holder faces;
+	unsigned int i;
+	uint32_t glyph_index;
+	// the ink so far, in X coordinates
+	int left, top, right, bottom;
+	bool inked = false;
+	struct xcbft_font *font;
+	struct xcbft_glyph_metrics *metrics;
+	struct xcbft_text_extents extents;
 
-	faces.length = 0;
+	memset(&extents, 0, sizeof(struct xcbft_text_extents));
+	if (faces.length == 0) {
+		return extents;
+	}
+	left = top = right = bottom = 0;
 
-	// add characters we need to a charset
-	charset = FcCharSetCreate();
-	FcCharSetAddChar(charset, character);
+	xcbft_coverage_prepare(ctx, faces, text);
 
-	// if we pass a pattern then copy it to get something close
-	if (copy_pattern != NULL) {
-		charset_pattern = FcPatternDuplicate(copy_pattern);
-	} else {
-		charset_pattern = FcPatternCreate();
+	// at least the ones of the first face, even without text
+	font = faces.faces[0];
+	for (i = 0; i <= text.length; i++) {
+		xcbft_font_activate(font);
+		if (font->face->size->metrics.ascender/64 > extents.ascent) {
+			extents.ascent = font->face->size->metrics.ascender/64;
+		}
+		if (-font->face->size->metrics.descender/64 >
+			extents.descent) {
+			extents.descent =
+				-font->face->size->metrics.descender/64;
+		}
+		if (i == text.length) {
+			break;
+		}
+
+		font = xcbft_coverage_lookup(ctx, faces, text.str[i],
+			&glyph_index);
+		metrics = xcbft_font_metrics(font, glyph_index);
+		// the pen moves the same way as when drawn
+		if (metrics->x_max > metrics->x_min &&
+			metrics->y_max > metrics->y_min) {
+			if (!inked || extents.advance.x+metrics->x_min < left) {
+				left = extents.advance.x+metrics->x_min;
+			}
+			if (!inked || extents.advance.y-metrics->y_max < top) {
+				top = extents.advance.y-metrics->y_max;
+			}
+			if (!inked || extents.advance.x+metrics->x_max > right) {
+				right = extents.advance.x+metrics->x_max;
+			}
+			if (!inked || extents.advance.y-metrics->y_min > bottom) {
+				bottom = extents.advance.y-metrics->y_min;
+			}
+			inked = true;
+		}
+		extents.advance.x += metrics->x_advance;
+		extents.advance.y += metrics->y_advance;
 	}
 
-	// use the charset for the pattern search
-	FcPatternAddCharSet(charset_pattern, FC_CHARSET, charset);
+	extents.x = left;
+	extents.y = top;
+	extents.width = right-left;
+	extents.height = bottom-top;
+
+	return extents;
+}
+
+/*
+ * Metrics of the glyph at the size of the font, loaded from its outline
+ * the first time.
+ */
+static struct xcbft_glyph_metrics *
+xcbft_font_metrics(struct xcbft_font *font, uint32_t glyph_index)
+{
+	FT_BBox box;
+	FT_GlyphSlot glyph;
+	struct xcbft_glyph_metrics **page, *metrics;
+	static struct xcbft_glyph_metrics empty;
+
+	if (glyph_index >= (uint32_t)font->face->num_glyphs) {
+		return &empty;
+	}
+	if (font->metrics == NULL) {
+		font->metrics = calloc((font->face->num_glyphs+255)/256,
+			sizeof(struct xcbft_glyph_metrics *));
+	}
+	page = &font->metrics[glyph_index >> 8];
+	if (*page == NULL) {
+		*page = calloc(256, sizeof(struct xcbft_glyph_metrics));
+	}
+	metrics = &(*page)[glyph_index & 0xff];
+	if (metrics->loaded) {
+		return metrics;
+	}
+
+	// same hinting as when drawn so that the advances match, without
+	// rendering
+	xcbft_font_activate(font);
+	metrics->loaded = true;
+	if (FT_Load_Glyph(font->face, glyph_index,
+		font->load_flags & ~FT_LOAD_RENDER) != FT_Err_Ok) {
+		return metrics;
+	}
+	glyph = font->face->glyph;
+
+	// as in the glyphinfos
+	metrics->x_advance = glyph->advance.x/64;
+	metrics->y_advance = glyph->advance.y/64;
+	if (glyph->format == FT_GLYPH_FORMAT_OUTLINE) {
+		// the transformation is already applied to the outline
+		FT_Outline_Get_CBox(&glyph->outline, &box);
+		metrics->x_min = floor(box.xMin/64.0);
+		metrics->y_min = floor(box.yMin/64.0);
+		metrics->x_max = ceil(box.xMax/64.0);
+		metrics->y_max = ceil(box.yMax/64.0);
+	} else {
+		metrics->x_min = glyph->bitmap_left;
+		metrics->y_max = glyph->bitmap_top;
+		metrics->x_max = glyph->bitmap_left + glyph->bitmap.width;
+		metrics->y_min = glyph->bitmap_top - (int)glyph->bitmap.rows;
+	}
+
+	return metrics;
+}
+
+/*
+ * Create a pixmap of the depth of the screen holding the text on the
+ * background color, exactly the size of the text with a margin of a fifth
+ * of the font size around it.
+ * Give it back with xcbft_release_text_pixmap so that it is used again for
+ * the next texts of the same size, or invalidate and free it as any other
+ * drawable.
+ */
+xcb_pixmap_t
+xcbft_create_text_pixmap(
+	struct xcbft_context *ctx,
+	struct utf_holder text,
+	xcb_render_color_t text_color,
+	xcb_render_color_t background_color,
+	struct xcbft_face_holder faces)
+{
+	unsigned int i;
+	xcb_connection_t *c = ctx->c;
+	xcb_pixmap_t pmap = XCB_NONE;
+	xcb_screen_t *screen;
+	xcb_render_picture_t picture;
+	xcb_render_pictformat_t format;
+	struct xcbft_text_extents extents;
+	struct xcbft_pooled_pixmap *pooled = NULL;
+	struct xcbft_pixmap_pool *pool = &ctx->pixmap_pool;
+	double pix_size = 12;
+	int left, top, right, bottom, margin;
+	uint16_t width, height;
+
+	screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+	format = xcbft_format_for_depth(ctx, screen->root_depth);
+	if (format == XCB_NONE || faces.length == 0) {
+		return XCB_NONE;
+	}
+
+	// measured first, so that the pixmap is created once at the right size
+	extents = xcbft_text_extents(ctx, faces, text);
+	// the char size is in points at the dpi of the context
+	pix_size = faces.faces[0]->char_size/64.0*ctx->dpi/72.0;
+	margin = 0.2*pix_size;
+
+	// the line and the ink, whichever goes further
+	left = extents.x < 0 ? extents.x : 0;
+	right = extents.x+extents.width > extents.advance.x ?
+		extents.x+extents.width : extents.advance.x;
+	top = extents.y < -extents.ascent ? extents.y : -extents.ascent;
+	bottom = extents.y+extents.height > extents.descent ?
+		extents.y+extents.height : extents.descent;
+	width = right-left+2*margin;
+	height = bottom-top+2*margin;
+	if (width == 0) width = 1;
+	if (height == 0) height = 1;
+
+	// one that was given back, it already has its picture
+	for (i = 0; i < pool->length; i++) {
+		if (!pool->pixmaps[i].in_use &&
+			pool->pixmaps[i].width == width &&
+			pool->pixmaps[i].height == height &&
+			pool->pixmaps[i].depth == screen->root_depth) {
+			pooled = &pool->pixmaps[i];
+			pmap = pooled->pixmap;
+			break;
+		}
+	}
+
+	if (pmap == XCB_NONE) {
+		// a free place, or that of one that wasn't used again once
+		// the pool is full
+		if (pool->length < XCBFT_PIXMAP_POOL_LENGTH) {
+			pooled = &pool->pixmaps[pool->length];
+			pool->length++;
+		} else {
+			for (i = 0; i < pool->length; i++) {
+				if (!pool->pixmaps[i].in_use) {
+					pooled = &pool->pixmaps[i];
+					xcbft_invalidate_drawable(ctx,
+						pooled->pixmap);
+					xcb_free_pixmap(c, pooled->pixmap);
+					break;
+				}
+			}
+		}
+
+		pmap = xcb_generate_id(c);
+		xcb_create_pixmap(c, screen->root_depth, pmap, screen->root,
+			width, height);
+		// the format is known, no need to ask the server
+		xcbft_add_picture(ctx, pmap, format);
+
+		// otherwise it is only freed by the application
+		if (pooled != NULL) {
+			pooled->pixmap = pmap;
+			pooled->width = width;
+			pooled->height = height;
+			pooled->depth = screen->root_depth;
+		}
+	}
+	if (pooled != NULL) {
+		pooled->in_use = true;
+	}
+	picture = xcbft_get_picture(ctx, pmap);
+
+	// fill the whole pixmap with a single color, through render so that
+	// no GC is needed
+	xcb_rectangle_t rectangles[] = { { .x = 0, .y = 0,
+			.width = width, .height = height } };
+	background_color.alpha = 0xffff;
+	xcb_render_fill_rectangles(c, XCB_RENDER_PICT_OP_SRC, picture,
+		background_color, 1, rectangles);
+
+	xcbft_draw_text_picture(ctx, picture,
+		margin-left, margin-top, // x, y
+		text, text_color, faces);
+
+	return pmap;
+}
+
+/*
+ * Give back a pixmap of xcbft_create_text_pixmap, it is kept for the next
+ * text of the same size and freed with the context.
+ */
+void
+xcbft_release_text_pixmap(struct xcbft_context *ctx, xcb_pixmap_t pmap)
+{
+	unsigned int i;
+	struct xcbft_pixmap_pool *pool = &ctx->pixmap_pool;
+
+	for (i = 0; i < pool->length; i++) {
+		if (pool->pixmaps[i].pixmap == pmap &&
+			pool->pixmaps[i].in_use) {
+			pool->pixmaps[i].in_use = false;
+			return;
+		}
+	}
+
+	// there was no room to keep it
+	xcbft_invalidate_drawable(ctx, pmap);
+	xcb_free_pixmap(ctx->c, pmap);
+}
+
+/*
+ * Stop following a pixmap lent by xcbft_create_text_pixmap that the
+ * application frees itself.
+ */
+static void
+xcbft_pixmap_pool_forget(struct xcbft_context *ctx, xcb_pixmap_t pmap)
+{
+	unsigned int i;
+	struct xcbft_pixmap_pool *pool = &ctx->pixmap_pool;
+
+	for (i = 0; i < pool->length; i++) {
+		if (pool->pixmaps[i].pixmap == pmap &&
+			pool->pixmaps[i].in_use) {
+			pool->pixmaps[i] = pool->pixmaps[pool->length-1];
+			pool->length--;
+			return;
+		}
+	}
+}
+
+/*
+ * Do the font queries through fontconfig and return the info
+ *
+ * Assumes:
+ *	Fontconfig is already init & cleaned outside
+ *	the FcPattern return needs to be cleaned outside
+ */
+FcPattern*
+xcbft_query_fontsearch(FcChar8 *fontquery)
+{
+	FcBool status;
+	FcPattern *fc_finding_pattern, *pat_output;
+	FcResult result;
+
+	fc_finding_pattern = FcNameParse(fontquery);
+
+	// to match we need to fix the pattern (fill unspecified info), the
+	// configuration first so that its render settings aren't hidden by
+	// the defaults
+	status = FcConfigSubstitute(NULL, fc_finding_pattern, FcMatchPattern);
+	xcbft_pattern_default_hint_style(fc_finding_pattern);
+	FcDefaultSubstitute(fc_finding_pattern);
+	if (status == FcFalse) {
+		fprintf(stderr, "could not perform config font substitution");
+		return NULL;
+	}
+
+	pat_output = FcFontMatch(NULL, fc_finding_pattern, &result);
+
+	FcPatternDestroy(fc_finding_pattern);
+	if (result == FcResultMatch) {
+		return pat_output;
+	} else if (result == FcResultNoMatch) {
+		fprintf(stderr, "there wasn't a match");
+	} else {
+		fprintf(stderr, "the match wasn't as good as it should be");
+	}
+	return NULL;
+}
+
+/*
+ * Query a font based on character support
+ * Optionally pass a pattern that it'll use as the base for the search
+ *
+ * fallback of font added to the list or somehow done when drawing,
+ * to do that we need to search by the charset we want to draw
+ * and if they are in one of the font already specified, thus need to
+ * know what the users want to insert as text. This needs more thinking
+ * to be decoupled.
+
+	Assumes the ft2 library is already loaded
+	Assumes the face will be cleaned outside
+ */
+struct xcbft_face_holder
+xcbft_query_by_char_support(struct xcbft_context *ctx, FcChar32 character,
+		const FcPattern *copy_pattern)
+{
+	FcBool status;
+	FcResult result;
+	FcCharSet *charset;
+	FcPattern *charset_pattern, *pat_output;
+	struct xcbft_patterns_holder patterns;
+	struct xcbft_face_holder faces;
+
+	faces.faces = NULL;
+	faces.length = 0;
+	faces.coverage = NULL;
+	faces.refs = NULL;
+
+	// add characters we need to a charset
+	charset = FcCharSetCreate();
+	FcCharSetAddChar(charset, character);
+
+	// if we pass a pattern then copy it to get something close
+	if (copy_pattern != NULL) {
+		charset_pattern = FcPatternDuplicate(copy_pattern);
+	} else {
+		charset_pattern = FcPatternCreate();
+	}
+
+	// use the charset for the pattern search
+	FcPatternAddCharSet(charset_pattern, FC_CHARSET, charset);
 	// also force it to be scalable
 	FcPatternAddBool(charset_pattern, FC_SCALABLE, FcTrue);
 
-	// default & config substitutions, the usual
-	FcDefaultSubstitute(charset_pattern);
+	// config & default substitutions, the usual
 	status = FcConfigSubstitute(NULL, charset_pattern, FcMatchPattern);
 	if (status == FcFalse) {
 		fprintf(stderr, "could not perform config font substitution");
 		FcCharSetDestroy(charset);
 		return faces;
 	}
+	xcbft_pattern_default_hint_style(charset_pattern);
+	FcDefaultSubstitute(charset_pattern);
 
 	pat_output = FcFontMatch(NULL, charset_pattern, &result);
 
@@ -251,7 +1491,7 @@ xcbft_query_by_char_support(FcChar32 character,
 	patterns.length = 1;
 	patterns.patterns[0] = pat_output;
 
-	faces = xcbft_load_faces(patterns, dpi);
+	faces = xcbft_load_faces(ctx, patterns);
 
 	// cleanup
 	xcbft_patterns_holder_destroy(patterns);
@@ -325,25 +1565,31 @@ xcbft_get_pixel_size(struct xcbft_patterns_holder patterns)
 }
 
 struct xcbft_face_holder
-xcbft_load_faces(struct xcbft_patterns_holder patterns, long dpi)
+xcbft_load_faces(struct xcbft_context *ctx,
+	struct xcbft_patterns_holder patterns)
 {
 	int i;
 	struct xcbft_face_holder faces;
+	struct xcbft_font *font;
 	FcResult result;
-	FcValue fc_file, fc_index, fc_matrix, fc_pixel_size;
+	FcValue fc_file, fc_index, fc_matrix, fc_pixel_size, fc_style;
+	FcCharSet *charset;
 	FT_Matrix ft_matrix;
-	FT_Error error;
-	FT_Library library;
+	FT_F26Dot6 char_size;
+	FT_Int32 load_flags;
+	struct xcbft_face_ref *ref;
+	bool has_matrix;
+	const char *style_objects[] = { FC_WEIGHT, FC_SLANT };
+	unsigned int j;
+	long dpi = ctx->dpi;
 
 	faces.length = 0;
-	error = FT_Init_FreeType(&library);
-	if (error != FT_Err_Ok) {
-		perror(NULL);
-		return faces;
-	}
 
 	// allocate the same size as patterns as it should be <= its length
-	faces.faces = malloc(sizeof(FT_Face)*patterns.length);
+	faces.faces = malloc(sizeof(struct xcbft_font *)*patterns.length);
+	faces.coverage = calloc(1, sizeof(struct xcbft_coverage));
+	faces.refs = calloc(patterns.length ? patterns.length : 1,
+		sizeof(struct xcbft_face_ref));
 
 	for (i = 0; i < patterns.length; i++) {
 		// get the information needed from the pattern
@@ -359,43 +1605,15 @@ xcbft_load_faces(struct xcbft_patterns_holder patterns, long dpi)
 			fc_index.u.i = 0;
 		}
 		// TODO: load more info like
-		//	autohint
-		//	hinting
 		//	verticallayout
 
-		// load the face
-		error = FT_New_Face(
-				library,
-				(const char *) fc_file.u.s,
-				fc_index.u.i,
-				&(faces.faces[faces.length]) );
-		if (error == FT_Err_Unknown_File_Format) {
-			fprintf(stderr, "wrong file format");
-			continue;
-		} else if (error == FT_Err_Cannot_Open_Resource) {
-			fprintf(stderr, "could not open resource");
-			continue;
-		} else if (error) {
-			fprintf(stderr, "another sort of error");
-			continue;
-		}
-		if (faces.faces[faces.length] == NULL) {
-			fprintf(stderr, "face was empty");
-			continue;
-		}
-
 		result = FcPatternGet(patterns.patterns[i], FC_MATRIX, 0, &fc_matrix);
-		if (result == FcResultMatch) {
+		has_matrix = result == FcResultMatch;
+		if (has_matrix) {
 			ft_matrix.xx = (FT_Fixed)(fc_matrix.u.m->xx * 0x10000L);
 			ft_matrix.xy = (FT_Fixed)(fc_matrix.u.m->xy * 0x10000L);
 			ft_matrix.yx = (FT_Fixed)(fc_matrix.u.m->yx * 0x10000L);
 			ft_matrix.yy = (FT_Fixed)(fc_matrix.u.m->yy * 0x10000L);
-
-			// apply the matrix
-			FT_Set_Transform(
-				faces.faces[faces.length],
-				&ft_matrix,
-				NULL);
 		}
 
 		result = FcPatternGet(patterns.patterns[i], FC_PIXEL_SIZE, 0, &fc_pixel_size);
@@ -404,410 +1622,4238 @@ xcbft_load_faces(struct xcbft_patterns_holder patterns, long dpi)
 			fc_pixel_size.type = FcTypeInteger;
 			fc_pixel_size.u.d = 12;
 		}
-		//error = FT_Set_Pixel_Sizes(
-		//	faces.faces[faces.length],
-		//	0, // width
-		//	fc_pixel_size.u.d); // height
 
 		// pixel_size/ (dpi/72.0)
-		FT_Set_Char_Size(
-			faces.faces[faces.length], 0,
-			(fc_pixel_size.u.d/((double)dpi/72.0))*64,
-			dpi, dpi);
-		if (error != FT_Err_Ok) {
-			perror(NULL);
-			fprintf(stderr, "could not char size");
+		char_size = (fc_pixel_size.u.d/((double)dpi/72.0))*64;
+		load_flags = xcbft_load_flags(xcbft_pattern_settings(ctx,
+			patterns.patterns[i]), fc_pixel_size.u.d);
+
+		// the others are only opened when a codepoint needs them,
+		// most texts are covered by the first face
+		if (faces.length > 0) {
+			ref = &faces.refs[faces.length];
+			ref->file = strdup((const char *) fc_file.u.s);
+			ref->index = fc_index.u.i;
+			ref->char_size = char_size;
+			ref->has_matrix = has_matrix;
+			if (has_matrix) {
+				ref->matrix = ft_matrix;
+			}
+			ref->load_flags = load_flags;
+			if (FcPatternGetCharSet(patterns.patterns[i], FC_CHARSET,
+				0, &charset) == FcResultMatch) {
+				ref->charset = FcCharSetCopy(charset);
+			}
+			faces.faces[faces.length] = NULL;
+			faces.length++;
+			continue;
+		}
+
+		// the face is shared with the other sizes of the same file
+		font = xcbft_font_get(ctx,
+			(const char *) fc_file.u.s,
+			fc_index.u.i,
+			char_size,
+			has_matrix ? &ft_matrix : NULL,
+			load_flags);
+		if (font == NULL) {
 			continue;
 		}
 
-		faces.length++;
+		// the fallbacks look like the first face
+		if (faces.length == 0) {
+			faces.coverage->style = FcPatternCreate();
+			FcPatternAddDouble(faces.coverage->style,
+				FC_PIXEL_SIZE, fc_pixel_size.u.d);
+			for (j = 0; j < 2; j++) {
+				result = FcPatternGet(patterns.patterns[i],
+					style_objects[j], 0, &fc_style);
+				if (result == FcResultMatch) {
+					FcPatternAdd(faces.coverage->style,
+						style_objects[j], fc_style, FcFalse);
+				}
+			}
+		}
+
+		faces.faces[faces.length] = font;
+		faces.length++;
+	}
+
+	return faces;
+}
+
+/*
+ * Get a font from the file at that size and with those load flags, with its
+ * own reference.
+ * The file is opened once per context, the other sizes of the same face
+ * are FT_Size objects created on it and switched to when needed.
+ * The matrix can be NULL.
+ */
+struct xcbft_font *
+xcbft_font_get(struct xcbft_context *ctx, const char *file, int index,
+	FT_F26Dot6 char_size, const FT_Matrix *matrix, FT_Int32 load_flags)
+{
+	unsigned int i;
+	FT_Error error;
+	FT_Face face;
+	struct xcbft_font *font;
+	struct xcbft_font_file *mapping;
+	struct xcbft_face_entry *entry = NULL;
+	struct xcbft_face_cache *cache = &ctx->faces;
+
+	for (i = 0; i < cache->entries_length; i++) {
+		if (cache->entries[i]->index == index &&
+			strcmp(cache->entries[i]->file, file) == 0) {
+			entry = cache->entries[i];
+			break;
+		}
+	}
+
+	if (entry != NULL) {
+		for (i = 0; i < cache->fonts_length; i++) {
+			font = cache->fonts[i];
+			if (font->entry != entry ||
+				font->char_size != char_size ||
+				font->load_flags != load_flags ||
+				font->has_matrix != (matrix != NULL)) {
+				continue;
+			}
+			if (matrix != NULL && (
+				font->matrix.xx != matrix->xx ||
+				font->matrix.xy != matrix->xy ||
+				font->matrix.yx != matrix->yx ||
+				font->matrix.yy != matrix->yy)) {
+				continue;
+			}
+			font->refcount++;
+			return font;
+		}
+	} else {
+		// load the face
+		error = xcbft_face_open(ctx->library, file, index, &face,
+			&mapping);
+		if (error == FT_Err_Unknown_File_Format) {
+			fprintf(stderr, "wrong file format");
+			return NULL;
+		} else if (error == FT_Err_Cannot_Open_Resource) {
+			fprintf(stderr, "could not open resource");
+			return NULL;
+		} else if (error) {
+			fprintf(stderr, "another sort of error");
+			return NULL;
+		}
+		if (face == NULL) {
+			fprintf(stderr, "face was empty");
+			return NULL;
+		}
+		// once for all the lookups done on the face
+		FT_Select_Charmap(face, ft_encoding_unicode);
+
+		entry = calloc(1, sizeof(struct xcbft_face_entry));
+		entry->file = strdup(file);
+		entry->index = index;
+		entry->face = face;
+		entry->mapping = mapping;
+		cache->entries = realloc(cache->entries,
+			sizeof(struct xcbft_face_entry *) *
+			(cache->entries_length+1));
+		cache->entries[cache->entries_length] = entry;
+		cache->entries_length++;
+	}
+
+	font = calloc(1, sizeof(struct xcbft_font));
+	font->entry = entry;
+	font->face = entry->face;
+	font->char_size = char_size;
+	font->load_flags = load_flags;
+	font->refcount = 1;
+	if (matrix != NULL) {
+		font->has_matrix = true;
+		font->matrix = *matrix;
+	}
+
+	error = FT_New_Size(entry->face, &font->size);
+	if (error == FT_Err_Ok) {
+		FT_Activate_Size(font->size);
+		error = FT_Set_Char_Size(entry->face, 0, char_size,
+			ctx->dpi, ctx->dpi);
+	}
+	if (error != FT_Err_Ok) {
+		fprintf(stderr, "could not char size");
+		if (font->size != NULL) {
+			FT_Done_Size(font->size);
+		}
+		free(font);
+		if (entry->refcount == 0) {
+			// just opened for this font
+			cache->entries_length--;
+			FT_Done_Face(entry->face);
+			xcbft_font_file_release(entry->mapping);
+			free(entry->file);
+			free(entry);
+		}
+		return NULL;
+	}
+	entry->refcount++;
+
+	cache->fonts = realloc(cache->fonts,
+		sizeof(struct xcbft_font *) * (cache->fonts_length+1));
+	cache->fonts[cache->fonts_length] = font;
+	cache->fonts_length++;
+
+	return font;
+}
+
+/*
+ * Drop a reference to the font, the last one frees its glyphsets, its size
+ * and the face if no other size uses it.
+ */
+void
+xcbft_font_release(struct xcbft_context *ctx, struct xcbft_font *font)
+{
+	unsigned int i;
+	struct xcbft_face_entry *entry = font->entry;
+	struct xcbft_face_cache *cache = &ctx->faces;
+
+	font->refcount--;
+	if (font->refcount > 0) {
+		return;
+	}
+
+	xcbft_glyph_cache_forget_font(ctx->glyph_cache, font);
+	FT_Done_Size(font->size);
+	if (font->metrics != NULL) {
+		for (i = 0; i < (font->face->num_glyphs+255)/256; i++) {
+			free(font->metrics[i]);
+		}
+		free(font->metrics);
+	}
+	for (i = 0; i < cache->fonts_length; i++) {
+		if (cache->fonts[i] == font) {
+			cache->fonts[i] = cache->fonts[cache->fonts_length-1];
+			cache->fonts_length--;
+			break;
+		}
+	}
+	free(font);
+
+	entry->refcount--;
+	if (entry->refcount > 0) {
+		return;
+	}
+
+	FT_Done_Face(entry->face);
+	xcbft_font_file_release(entry->mapping);
+	for (i = 0; i < cache->entries_length; i++) {
+		if (cache->entries[i] == entry) {
+			cache->entries[i] =
+				cache->entries[cache->entries_length-1];
+			cache->entries_length--;
+			break;
+		}
+	}
+	free(entry->file);
+	free(entry);
+}
+
+/*
+ * Create the face from the mapping of the file, shared with the other faces
+ * of the file in the process. The mapping is released after the face.
+ */
+static FT_Error
+xcbft_face_open(FT_Library library, const char *file, int index,
+	FT_Face *face, struct xcbft_font_file **mapping)
+{
+	FT_Error error;
+
+	*mapping = xcbft_font_file_open(file);
+	if (*mapping == NULL) {
+		return FT_Err_Cannot_Open_Resource;
+	}
+	error = FT_New_Memory_Face(library, (*mapping)->data,
+		(*mapping)->size, index, face);
+	if (error != FT_Err_Ok) {
+		xcbft_font_file_release(*mapping);
+		*mapping = NULL;
+	}
+	return error;
+}
+
+/*
+ * Map the font file read-only, or take a reference on it if it already
+ * is. The pages are those of the page cache, nothing is read nor copied
+ * until FreeType needs it.
+ * Returns NULL if it couldn't be mapped.
+ */
+static struct xcbft_font_file *
+xcbft_font_file_open(const char *path)
+{
+	int fd;
+	unsigned int i;
+	void *data;
+	struct stat st;
+	struct xcbft_font_file *file = NULL;
+	struct xcbft_font_files *files = &xcbft_font_files;
+
+	pthread_mutex_lock(&files->lock);
+	for (i = 0; i < files->length; i++) {
+		if (strcmp(files->files[i]->path, path) == 0) {
+			file = files->files[i];
+			file->refcount++;
+			pthread_mutex_unlock(&files->lock);
+			return file;
+		}
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		pthread_mutex_unlock(&files->lock);
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		pthread_mutex_unlock(&files->lock);
+		return NULL;
+	}
+	// the mapping stays when the descriptor is closed
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		pthread_mutex_unlock(&files->lock);
+		return NULL;
+	}
+
+	file = malloc(sizeof(struct xcbft_font_file));
+	file->path = strdup(path);
+	file->data = data;
+	file->size = st.st_size;
+	file->refcount = 1;
+	files->files = realloc(files->files,
+		sizeof(struct xcbft_font_file *)*(files->length+1));
+	files->files[files->length] = file;
+	files->length++;
+	pthread_mutex_unlock(&files->lock);
+
+	return file;
+}
+
+/*
+ * Drop a reference to the mapped file, the last one unmaps it.
+ */
+static void
+xcbft_font_file_release(struct xcbft_font_file *file)
+{
+	unsigned int i;
+	struct xcbft_font_files *files = &xcbft_font_files;
+
+	pthread_mutex_lock(&files->lock);
+	file->refcount--;
+	if (file->refcount > 0) {
+		pthread_mutex_unlock(&files->lock);
+		return;
+	}
+	for (i = 0; i < files->length; i++) {
+		if (files->files[i] == file) {
+			files->files[i] = files->files[files->length-1];
+			files->length--;
+			break;
+		}
+	}
+	if (files->length == 0) {
+		free(files->files);
+		files->files = NULL;
+	}
+	pthread_mutex_unlock(&files->lock);
+
+	munmap((void *)file->data, file->size);
+	free(file->path);
+	free(file);
+}
+
+/*
+ * Switch the shared face to the size and transformation of the font,
+ * needed before loading glyphs or reading the size metrics.
+ */
+void
+xcbft_font_activate(struct xcbft_font *font)
+{
+	FT_Activate_Size(font->size);
+	FT_Set_Transform(font->face,
+		font->has_matrix ? &font->matrix : NULL, NULL);
+}
+
+FcStrSet*
+xcbft_extract_fontsearch_list(char *string)
+{
+	FcStrSet *fontsearch = NULL;
+	FcChar8 *fontquery;
+	FcBool result = FcFalse;
+	char *r = strdup(string);
+	char *p_to_r = r;
+	char *token = NULL;
+
+	fontsearch = FcStrSetCreate();
+
+	token = strtok(r, ",");
+	while (token != NULL) {
+		fontquery = (FcChar8*)token;
+		result = FcStrSetAdd(fontsearch, fontquery);
+		if (result == FcFalse) {
+			fprintf(stderr,
+				"Couldn't add fontquery to fontsearch set");
+		}
+		token = strtok(NULL, ",");
+	}
+
+	free(p_to_r);
+
+	return fontsearch;
+}
+
+
+
+void
+xcbft_patterns_holder_destroy(struct xcbft_patterns_holder patterns)
+{
+	int i = 0;
+
+	for (; i < patterns.length; i++) {
+		FcPatternDestroy(patterns.patterns[i]);
+	}
+	free(patterns.patterns);
+	// FcFini(); // TODO: we can't leave that here, find a way for cleanup
+}
+
+/*
+ * Release the fonts, the ones that aren't used anywhere else are freed
+ * along with their glyphsets.
+ */
+void
+xcbft_face_holder_destroy(struct xcbft_context *ctx,
+	struct xcbft_face_holder faces)
+{
+	int i = 0;
+
+	for (; i < faces.length; i++) {
+		if (faces.faces[i] != NULL) {
+			xcbft_font_release(ctx, faces.faces[i]);
+		}
+		if (faces.refs != NULL) {
+			free(faces.refs[i].file);
+			if (faces.refs[i].charset != NULL) {
+				FcCharSetDestroy(faces.refs[i].charset);
+			}
+		}
+	}
+	free(faces.refs);
+	if (faces.coverage != NULL) {
+		xcbft_coverage_destroy(faces.coverage);
+	}
+	if (faces.faces) {
+		free(faces.faces);
+	}
+}
+
+/*
+ * Get the patterns and faces of a comma separated font list, as given to
+ * xcbft_extract_fontsearch_list.
+ * The lists are kept in the context by their text, asking for the same one
+ * again doesn't go through fontconfig as long as its configuration is the
+ * same.
+ * The spec is given with a reference to release with
+ * xcbft_font_spec_release, before the context is destroyed.
+ */
+struct xcbft_font_spec *
+xcbft_font_spec_get(struct xcbft_context *ctx, const char *fontsearch)
+{
+	unsigned int i;
+	char *query;
+	FcConfig *config;
+	FcStrSet *list;
+	struct xcbft_font_spec *spec;
+	struct xcbft_spec_cache *cache = &ctx->specs;
+
+	// the matches are only valid for the configuration they were done
+	// with, it is replaced when fontconfig reloads it
+	config = FcConfigGetCurrent();
+	if (config != cache->config) {
+		xcbft_spec_cache_clear(ctx);
+		cache->config = FcConfigReference(config);
+	}
+
+	query = xcbft_normalize_fontsearch(fontsearch);
+	for (i = 0; i < cache->length; i++) {
+		if (strcmp(cache->specs[i]->query, query) == 0) {
+			free(query);
+			cache->specs[i]->refcount++;
+			return cache->specs[i];
+		}
+	}
+
+	spec = calloc(1, sizeof(struct xcbft_font_spec));
+	if (spec == NULL) {
+		perror(NULL);
+		free(query);
+		return NULL;
+	}
+	spec->query = query;
+	list = xcbft_extract_fontsearch_list(query);
+	spec->patterns = xcbft_query_fontsearch_all(list);
+	FcStrSetDestroy(list);
+	spec->faces = xcbft_load_faces(ctx, spec->patterns);
+	// the one of the cache and the one given
+	spec->refcount = 2;
+
+	cache->specs = realloc(cache->specs,
+		sizeof(struct xcbft_font_spec *)*(cache->length+1));
+	cache->specs[cache->length] = spec;
+	cache->length++;
+
+	return spec;
+}
+
+void
+xcbft_font_spec_release(struct xcbft_context *ctx,
+	struct xcbft_font_spec *spec)
+{
+	spec->refcount--;
+	if (spec->refcount > 0) {
+		return;
+	}
+	xcbft_face_holder_destroy(ctx, spec->faces);
+	xcbft_patterns_holder_destroy(spec->patterns);
+	free(spec->query);
+	free(spec);
+}
+
+/*
+ * Drop the references of the cache, to the specs and the configuration,
+ * the specs still in use stay valid until they are released.
+ */
+static void
+xcbft_spec_cache_clear(struct xcbft_context *ctx)
+{
+	unsigned int i;
+	struct xcbft_spec_cache *cache = &ctx->specs;
+
+	for (i = 0; i < cache->length; i++) {
+		xcbft_font_spec_release(ctx, cache->specs[i]);
+	}
+	free(cache->specs);
+	cache->specs = NULL;
+	cache->length = 0;
+	if (cache->config != NULL) {
+		FcConfigDestroy(cache->config);
+		cache->config = NULL;
+	}
+}
+
+/*
+ * Remove the blanks around the entries of the list and the empty entries,
+ * so that the same list written differently is found in the cache.
+ */
+static char *
+xcbft_normalize_fontsearch(const char *fontsearch)
+{
+	const char *start, *end, *next;
+	char *query;
+	size_t length = 0;
+
+	query = malloc(strlen(fontsearch)+1);
+	for (start = fontsearch; *start != '\0'; start = next) {
+		next = strchr(start, ',');
+		if (next == NULL) {
+			next = start + strlen(start);
+		}
+		end = next;
+		while (start < end && isspace((unsigned char)*start)) {
+			start++;
+		}
+		while (end > start && isspace((unsigned char)end[-1])) {
+			end--;
+		}
+		if (end > start) {
+			if (length > 0) {
+				query[length++] = ',';
+			}
+			memcpy(query+length, start, end-start);
+			length += end-start;
+		}
+		if (*next == ',') {
+			next++;
+		}
+	}
+	query[length] = '\0';
+
+	return query;
+}
+
+FT_Vector
+xcbft_draw_text(
+	struct xcbft_context *ctx, // long-lived state of the connection
+	xcb_drawable_t pmap, // win or pixmap
+	int16_t x, int16_t y, // x, y
+	struct utf_holder text, // text
+	xcb_render_color_t color,
+	struct xcbft_face_holder faces)
+{
+	FT_Vector advance;
+	// the picture of the drawable, created on the first draw
+	xcb_render_picture_t picture = xcbft_get_picture(ctx, pmap);
+
+	if (picture == XCB_NONE) {
+		advance.x = advance.y = 0;
+		return advance;
+	}
+
+	return xcbft_draw_text_picture(ctx, picture, x, y, text, color, faces);
+}
+
+/*
+ * Same as xcbft_draw_text on a picture the application already has.
+ */
+FT_Vector
+xcbft_draw_text_picture(
+	struct xcbft_context *ctx, // long-lived state of the connection
+	xcb_render_picture_t picture, // destination
+	int16_t x, int16_t y, // x, y
+	struct utf_holder text, // text
+	xcb_render_color_t color,
+	struct xcbft_face_holder faces)
+{
+	struct xcbft_text_run run;
+
+	run.x = x;
+	run.y = y;
+	run.text = text;
+	run.faces = faces;
+	run.color = color;
+	xcbft_draw_runs_picture(ctx, picture, &run, 1);
+
+	return run.advance;
+}
+
+/*
+ * Draw many texts at once, the ones of the same color go in a single
+ * request, moving from one to the other within the glyph stream.
+ * The advance of every run is set.
+ */
+void
+xcbft_draw_runs(struct xcbft_context *ctx, xcb_drawable_t drawable,
+	struct xcbft_text_run *runs, unsigned int length)
+{
+	unsigned int i;
+	// the picture of the drawable, created on the first draw
+	xcb_render_picture_t picture = xcbft_get_picture(ctx, drawable);
+
+	if (picture == XCB_NONE) {
+		for (i = 0; i < length; i++) {
+			runs[i].advance.x = runs[i].advance.y = 0;
+		}
+		return;
+	}
+
+	xcbft_draw_runs_picture(ctx, picture, runs, length);
+}
+
+/*
+ * Same as xcbft_draw_runs on a picture the application already has.
+ */
+void
+xcbft_draw_runs_picture(struct xcbft_context *ctx,
+	xcb_render_picture_t picture,
+	struct xcbft_text_run *runs, unsigned int length)
+{
+	unsigned int i, j, k, r, first, total, changes;
+	uint32_t max_glyph;
+	int16_t dx, dy;
+	FT_Vector pen;
+	xcb_render_glyphset_t glyphset;
+	xcb_render_picture_t fg_pen;
+	xcb_render_util_composite_text_stream_t *ts;
+	struct xcbft_glyphset_and_advance *loaded, *run;
+	uint8_t *glyphs_8 = NULL;
+	uint16_t *glyphs_16 = NULL;
+	bool *drawn;
+	xcb_connection_t *c = ctx->c;
+
+	loaded = malloc(sizeof(struct xcbft_glyphset_and_advance) *
+		(length ? length : 1));
+	drawn = calloc(length ? length : 1, sizeof(bool));
+
+	// upload the glyphs that aren't already in the cached glyphsets, for
+	// all the runs together
+	for (r = 0; r < length; r++) {
+		loaded[r] = xcbft_stage_glyphset(ctx, runs[r].faces,
+			runs[r].text);
+		runs[r].advance = loaded[r].advance;
+	}
+	xcbft_glyph_cache_upload(ctx->glyph_cache);
+
+	for (first = 0; first < length; first++) {
+		if (drawn[first] || runs[first].text.length == 0) {
+			continue;
+		}
+
+		// the runs of the same color, and the glyphset switches
+		// between all of their characters
+		total = changes = max_glyph = 0;
+		glyphset = loaded[first].glyphsets[0];
+		for (r = first; r < length; r++) {
+			if (runs[r].text.length == 0 ||
+				memcmp(&runs[r].color, &runs[first].color,
+				sizeof(xcb_render_color_t)) != 0) {
+				continue;
+			}
+			for (i = 0; i < runs[r].text.length; i++) {
+				if (loaded[r].glyphsets[i] != glyphset) {
+					glyphset = loaded[r].glyphsets[i];
+					changes++;
+				}
+			}
+			total += runs[r].text.length;
+			if (loaded[r].max_glyph > max_glyph) {
+				max_glyph = loaded[r].max_glyph;
+			}
+		}
+
+		// we now have a text stream - a bunch of glyphs basically
+		glyphset = loaded[first].glyphsets[0];
+		ts = xcb_render_util_composite_text_stream(glyphset, total,
+			changes);
+
+		// the position of the first element is from the origin of
+		// the picture, the others from where the previous one stopped
+		pen.x = pen.y = 0;
+		for (r = first; r < length; r++) {
+			if (runs[r].text.length == 0 ||
+				memcmp(&runs[r].color, &runs[first].color,
+				sizeof(xcb_render_color_t)) != 0) {
+				continue;
+			}
+			run = &loaded[r];
+			dx = runs[r].x - pen.x;
+			dy = runs[r].y - pen.y;
+
+			// the ids are dense, most texts fit in 8 or 16 bits
+			// per glyph
+			if (max_glyph <= UINT8_MAX) {
+				glyphs_8 = realloc(glyphs_8,
+					runs[r].text.length);
+				for (i = 0; i < runs[r].text.length; i++) {
+					glyphs_8[i] = run->glyphs[i];
+				}
+			} else if (max_glyph <= UINT16_MAX) {
+				glyphs_16 = realloc(glyphs_16,
+					sizeof(uint16_t)*runs[r].text.length);
+				for (i = 0; i < runs[r].text.length; i++) {
+					glyphs_16[i] = run->glyphs[i];
+				}
+			}
+
+			for (i = 0; i < runs[r].text.length; i = j) {
+				if (run->glyphsets[i] != glyphset) {
+					glyphset = run->glyphsets[i];
+					xcb_render_util_change_glyphset(ts,
+						glyphset);
+				}
+				// renderutil doesn't take more than 252 glyphs
+				// per element
+				for (j = i+1; j < runs[r].text.length &&
+					j-i < 252; j++) {
+					if (run->glyphsets[j] != glyphset) {
+						break;
+					}
+				}
+				if (glyphs_8 != NULL) {
+					xcb_render_util_glyphs_8(ts, dx, dy,
+						j-i, glyphs_8+i);
+				} else if (glyphs_16 != NULL) {
+					xcb_render_util_glyphs_16(ts, dx, dy,
+						j-i, glyphs_16+i);
+				} else {
+					xcb_render_util_glyphs_32(ts, dx, dy,
+						j-i, run->glyphs+i);
+				}
+				dx = dy = 0;
+			}
+
+			pen.x = runs[r].x + run->advance.x;
+			pen.y = runs[r].y + run->advance.y;
+			drawn[r] = true;
+		}
+
+		// solid fill of the color, kept in the context between draws
+		fg_pen = xcbft_get_pen(ctx, runs[first].color);
+
+		// finally render using the repeated pen color on the picture
+		// (which is related to the pixmap)
+		xcb_render_util_composite_text(
+				c, // connection
+				XCB_RENDER_PICT_OP_OVER, //op
+				fg_pen, // src
+				picture, // dst
+				0, // fmt
+				0, // src x
+				0, // src y
+				ts); // txt stream
+		xcb_render_util_composite_text_free(ts);
+
+		free(glyphs_8);
+		free(glyphs_16);
+		glyphs_8 = NULL;
+		glyphs_16 = NULL;
+	}
+
+	for (k = 0; k < length; k++) {
+		free(loaded[k].glyphsets);
+		free(loaded[k].glyphs);
+	}
+	free(loaded);
+	free(drawn);
+
+	if (ctx->auto_flush) {
+		xcb_flush(c);
+	}
+}
+
+/*
+ * Create a grid of cells at (x, y) on the drawable, all of them blank with
+ * the background color.
+ * The cells take the advance of 'M' with the faces, which should be
+ * monospace, and their height.
+ * The faces have to stay loaded as long as the grid is there.
+ * Returns NULL when the faces have no advance.
+ */
+struct xcbft_grid *
+xcbft_grid_create(struct xcbft_context *ctx, xcb_drawable_t drawable,
+	struct xcbft_face_holder faces, int16_t x, int16_t y,
+	uint16_t columns, uint16_t rows,
+	xcb_render_color_t fg, xcb_render_color_t bg)
+{
+	size_t i, count;
+	uint32_t values[1];
+	uint32_t sample_str[1] = { 'M' };
+	struct xcbft_grid *grid;
+	struct utf_holder sample;
+	struct xcbft_text_extents extents;
+
+	if (faces.length == 0 || columns == 0 || rows == 0) {
+		return NULL;
+	}
+
+	// the advance of an actual character, the max advance of the face
+	// is often wider or not set at all for bitmap faces
+	sample.str = sample_str;
+	sample.length = 1;
+	extents = xcbft_text_extents(ctx, faces, sample);
+	if (extents.advance.x <= 0) {
+		fprintf(stderr, "the faces of the grid have no advance\n");
+		return NULL;
+	}
+
+	// the runs are the largest of the arrays by cells
+	count = (size_t)columns*rows;
+	if (count > SIZE_MAX/sizeof(struct xcbft_text_run)) {
+		fprintf(stderr, "the grid has too many cells\n");
+		return NULL;
+	}
+
+	grid = calloc(1, sizeof(struct xcbft_grid));
+	if (grid == NULL) {
+		perror(NULL);
+		return NULL;
+	}
+	grid->ctx = ctx;
+	grid->drawable = drawable;
+	grid->picture = xcbft_get_picture(ctx, drawable);
+	grid->faces = faces;
+	grid->x = x;
+	grid->y = y;
+	grid->columns = columns;
+	grid->rows = rows;
+	grid->fg = fg;
+	grid->bg = bg;
+
+	grid->cell_width = extents.advance.x;
+	grid->cell_height = extents.ascent + extents.descent;
+	grid->ascent = extents.ascent;
+
+	grid->cells = malloc(sizeof(struct xcbft_grid_cell)*count);
+	grid->shown = malloc(sizeof(struct xcbft_grid_cell)*count);
+	grid->dirty_first = malloc(sizeof(uint16_t)*rows);
+	grid->dirty_last = malloc(sizeof(uint16_t)*rows);
+	grid->codepoints = malloc(sizeof(uint32_t)*count);
+	grid->runs = malloc(sizeof(struct xcbft_text_run)*count);
+	grid->rectangles = malloc(sizeof(xcb_rectangle_t)*count);
+	grid->rectangle_colors = malloc(sizeof(xcb_render_color_t)*count);
+	if (grid->cells == NULL || grid->shown == NULL ||
+		grid->dirty_first == NULL || grid->dirty_last == NULL ||
+		grid->codepoints == NULL || grid->runs == NULL ||
+		grid->rectangles == NULL || grid->rectangle_colors == NULL) {
+		perror(NULL);
+		xcbft_grid_free_arrays(grid);
+		free(grid);
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		grid->cells[i].codepoint = ' ';
+		grid->cells[i].fg = fg;
+		grid->cells[i].bg = bg;
+	}
+	// so that everything is drawn by the first render
+	xcbft_grid_invalidate(grid);
+
+	grid->gc = xcb_generate_id(ctx->c);
+	values[0] = 0;
+	xcb_create_gc(ctx->c, grid->gc, drawable,
+		XCB_GC_GRAPHICS_EXPOSURES, values);
+
+	return grid;
+}
+
+void
+xcbft_grid_destroy(struct xcbft_grid *grid)
+{
+	if (grid == NULL) {
+		return;
+	}
+	xcb_free_gc(grid->ctx->c, grid->gc);
+	xcbft_grid_free_arrays(grid);
+	free(grid);
+}
+
+static void
+xcbft_grid_free_arrays(struct xcbft_grid *grid)
+{
+	free(grid->cells);
+	free(grid->shown);
+	free(grid->dirty_first);
+	free(grid->dirty_last);
+	free(grid->codepoints);
+	free(grid->runs);
+	free(grid->rectangles);
+	free(grid->rectangle_colors);
+}
+
+/*
+ * Forget what is on the drawable, the next render draws all the cells,
+ * after the drawable was exposed or painted over for example.
+ */
+void
+xcbft_grid_invalidate(struct xcbft_grid *grid)
+{
+	unsigned int i;
+
+	for (i = 0; i < (unsigned int)grid->columns*grid->rows; i++) {
+		grid->shown[i].codepoint = XCBFT_GRID_UNKNOWN;
+	}
+	for (i = 0; i < grid->rows; i++) {
+		grid->dirty_first[i] = 0;
+		grid->dirty_last[i] = grid->columns;
+	}
+}
+
+/*
+ * Change a cell, it is drawn by the next render if it differs from what
+ * is shown.
+ */
+void
+xcbft_grid_set(struct xcbft_grid *grid, uint16_t column, uint16_t row,
+	uint32_t codepoint, xcb_render_color_t fg, xcb_render_color_t bg)
+{
+	unsigned int i;
+	struct xcbft_grid_cell *cell;
+
+	if (column >= grid->columns || row >= grid->rows) {
+		return;
+	}
+	i = row*grid->columns + column;
+	cell = &grid->cells[i];
+	cell->codepoint = codepoint;
+	cell->fg = fg;
+	cell->bg = bg;
+	if (memcmp(cell, &grid->shown[i], sizeof(struct xcbft_grid_cell))) {
+		xcbft_grid_damage(grid, row, column, column+1);
+	}
+}
+
+/*
+ * Change the cells from the column, as many as the text has characters
+ * that fit in the row.
+ */
+void
+xcbft_grid_set_text(struct xcbft_grid *grid, uint16_t column, uint16_t row,
+	struct utf_holder text, xcb_render_color_t fg, xcb_render_color_t bg)
+{
+	unsigned int i;
+
+	for (i = 0; i < text.length && column+i < grid->columns; i++) {
+		xcbft_grid_set(grid, column+i, row, text.str[i], fg, bg);
+	}
+}
+
+static void
+xcbft_grid_damage(struct xcbft_grid *grid, uint16_t row, uint16_t first,
+	uint16_t last)
+{
+	if (grid->dirty_first[row] >= grid->dirty_last[row]) {
+		grid->dirty_first[row] = first;
+		grid->dirty_last[row] = last;
+		return;
+	}
+	if (first < grid->dirty_first[row]) {
+		grid->dirty_first[row] = first;
+	}
+	if (last > grid->dirty_last[row]) {
+		grid->dirty_last[row] = last;
+	}
+}
+
+/*
+ * Move the content up by that many rows, down if negative, the rows
+ * uncovered are blank.
+ * What is already on the drawable is copied there by the server, only the
+ * new rows and the cells that changed are drawn by the next render.
+ */
+void
+xcbft_grid_scroll(struct xcbft_grid *grid, int lines)
+{
+	unsigned int i, kept, from, to, blank;
+	size_t row_size = sizeof(struct xcbft_grid_cell)*grid->columns;
+
+	if (lines == 0) {
+		return;
+	}
+	kept = abs(lines) < grid->rows ? grid->rows-abs(lines) : 0;
+	from = lines > 0 ? lines : 0;
+	to = lines > 0 ? 0 : -lines;
+
+	if (kept > 0) {
+		xcb_copy_area(grid->ctx->c, grid->drawable, grid->drawable,
+			grid->gc,
+			grid->x, grid->y + from*grid->cell_height,
+			grid->x, grid->y + to*grid->cell_height,
+			grid->columns*grid->cell_width,
+			kept*grid->cell_height);
+		// the cells not drawn yet go along with the others
+		memmove(grid->cells + to*grid->columns,
+			grid->cells + from*grid->columns, kept*row_size);
+		memmove(grid->shown + to*grid->columns,
+			grid->shown + from*grid->columns, kept*row_size);
+		memmove(grid->dirty_first + to, grid->dirty_first + from,
+			kept*sizeof(uint16_t));
+		memmove(grid->dirty_last + to, grid->dirty_last + from,
+			kept*sizeof(uint16_t));
+	}
+
+	// the rows uncovered
+	blank = lines > 0 ? kept : 0;
+	for (i = blank*grid->columns;
+		i < (blank+grid->rows-kept)*grid->columns; i++) {
+		grid->cells[i].codepoint = ' ';
+		grid->cells[i].fg = grid->fg;
+		grid->cells[i].bg = grid->bg;
+		grid->shown[i].codepoint = XCBFT_GRID_UNKNOWN;
+	}
+	for (i = blank; i < blank+grid->rows-kept; i++) {
+		grid->dirty_first[i] = 0;
+		grid->dirty_last[i] = grid->columns;
+	}
+}
+
+/*
+ * Draw the cells that changed since the last render, the backgrounds with
+ * a request per color and the characters with a glyph stream per color.
+ */
+void
+xcbft_grid_render(struct xcbft_grid *grid)
+{
+	unsigned int row, column, first, i, j, length;
+	unsigned int runs_length = 0, rectangles_length = 0;
+	unsigned int codepoints_length = 0;
+	struct xcbft_grid_cell *cells, *cell;
+	xcb_rectangle_t *same_color;
+	struct xcbft_context *ctx = grid->ctx;
+
+	if (grid->picture == XCB_NONE) {
+		return;
+	}
+
+	for (row = 0; row < grid->rows; row++) {
+		if (grid->dirty_first[row] >= grid->dirty_last[row]) {
+			continue;
+		}
+		cells = grid->cells + row*grid->columns;
+
+		// the backgrounds, a rectangle for the cells of the same
+		// color next to each other
+		for (column = grid->dirty_first[row];
+			column < grid->dirty_last[row]; column = first) {
+			first = column+1;
+			while (first < grid->dirty_last[row] &&
+				memcmp(&cells[first].bg, &cells[column].bg,
+				sizeof(xcb_render_color_t)) == 0) {
+				first++;
+			}
+			grid->rectangles[rectangles_length].x =
+				grid->x + column*grid->cell_width;
+			grid->rectangles[rectangles_length].y =
+				grid->y + row*grid->cell_height;
+			grid->rectangles[rectangles_length].width =
+				(first-column)*grid->cell_width;
+			grid->rectangles[rectangles_length].height =
+				grid->cell_height;
+			grid->rectangle_colors[rectangles_length] =
+				cells[column].bg;
+			rectangles_length++;
+		}
+
+		// the characters, a run per cell so that each glyph starts on
+		// its cell whatever its advance, the runs of the same color
+		// still go in a single glyph stream
+		for (column = grid->dirty_first[row];
+			column < grid->dirty_last[row]; column++) {
+			cell = &cells[column];
+			if (cell->codepoint == ' ' || cell->codepoint == 0) {
+				continue;
+			}
+			grid->codepoints[codepoints_length] = cell->codepoint;
+			grid->runs[runs_length].x =
+				grid->x + column*grid->cell_width;
+			grid->runs[runs_length].y =
+				grid->y + row*grid->cell_height + grid->ascent;
+			grid->runs[runs_length].text.str =
+				grid->codepoints+codepoints_length;
+			grid->runs[runs_length].text.length = 1;
+			grid->runs[runs_length].faces = grid->faces;
+			grid->runs[runs_length].color = cell->fg;
+			runs_length++;
+			codepoints_length++;
+		}
+
+		memcpy(grid->shown + row*grid->columns + grid->dirty_first[row],
+			cells + grid->dirty_first[row],
+			sizeof(struct xcbft_grid_cell) *
+			(grid->dirty_last[row]-grid->dirty_first[row]));
+		grid->dirty_first[row] = grid->columns;
+		grid->dirty_last[row] = 0;
+	}
+
+	// the rectangles of the same color together, in the space of the
+	// ones already sent
+	same_color = malloc(sizeof(xcb_rectangle_t)*
+		(rectangles_length ? rectangles_length : 1));
+	for (i = 0; i < rectangles_length; i++) {
+		if (grid->rectangles[i].width == 0) {
+			continue;
+		}
+		length = 0;
+		for (j = i; j < rectangles_length; j++) {
+			if (grid->rectangles[j].width == 0 ||
+				memcmp(&grid->rectangle_colors[j],
+				&grid->rectangle_colors[i],
+				sizeof(xcb_render_color_t)) != 0) {
+				continue;
+			}
+			same_color[length] = grid->rectangles[j];
+			length++;
+			if (j > i) {
+				grid->rectangles[j].width = 0;
+			}
+		}
+		xcb_render_fill_rectangles(ctx->c, XCB_RENDER_PICT_OP_SRC,
+			grid->picture, grid->rectangle_colors[i],
+			length, same_color);
+	}
+	free(same_color);
+
+	if (runs_length > 0) {
+		xcbft_draw_runs_picture(ctx, grid->picture, grid->runs,
+			runs_length);
+	} else if (rectangles_length > 0 && ctx->auto_flush) {
+		xcb_flush(ctx->c);
+	}
+}
+
+/*
+ * Create a slot for the texts drawn at (x, y) on the drawable, nothing is
+ * drawn until the first update.
+ * The background color is what the changed characters are cleared with,
+ * the faces have to stay loaded as long as the slot is there.
+ * Returns NULL without faces.
+ */
+struct xcbft_text_slot *
+xcbft_text_slot_create(struct xcbft_context *ctx, xcb_drawable_t drawable,
+	struct xcbft_face_holder faces, int16_t x, int16_t y,
+	xcb_render_color_t fg, xcb_render_color_t bg)
+{
+	struct xcbft_text_slot *slot;
+
+	// the metrics of the line come from the first face
+	if (faces.length == 0) {
+		return NULL;
+	}
+
+	slot = calloc(1, sizeof(struct xcbft_text_slot));
+	if (slot == NULL) {
+		perror(NULL);
+		return NULL;
+	}
+	slot->ctx = ctx;
+	slot->picture = xcbft_get_picture(ctx, drawable);
+	slot->faces = faces;
+	slot->x = x;
+	slot->y = y;
+	slot->fg = fg;
+	slot->bg = bg;
+
+	return slot;
+}
+
+void
+xcbft_text_slot_destroy(struct xcbft_text_slot *slot)
+{
+	if (slot == NULL) {
+		return;
+	}
+	free(slot->text);
+	free(slot->glyphs);
+	free(slot);
+}
+
+/*
+ * Forget what is on the drawable, the next update draws the whole text,
+ * after the drawable was exposed or painted over for example.
+ */
+void
+xcbft_text_slot_invalidate(struct xcbft_text_slot *slot)
+{
+	slot->drawn = false;
+}
+
+/*
+ * Place the characters of the text from the origin with the advances
+ * cached in the fonts, returning where the pen stops.
+ */
+static FT_Vector
+xcbft_text_slot_layout(struct xcbft_context *ctx,
+	struct xcbft_face_holder faces, struct utf_holder text,
+	struct xcbft_slot_glyph *glyphs)
+{
+	unsigned int i;
+	uint32_t glyph_index;
+	struct xcbft_font *font;
+	struct xcbft_glyph_metrics *metrics;
+	FT_Vector pen;
+
+	pen.x = pen.y = 0;
+	xcbft_coverage_prepare(ctx, faces, text);
+	for (i = 0; i < text.length; i++) {
+		font = xcbft_coverage_lookup(ctx, faces, text.str[i],
+			&glyph_index);
+		metrics = xcbft_font_metrics(font, glyph_index);
+		glyphs[i].pen = pen.x;
+		if (metrics->x_max > metrics->x_min &&
+			metrics->y_max > metrics->y_min) {
+			glyphs[i].left = pen.x + metrics->x_min;
+			glyphs[i].right = pen.x + metrics->x_max;
+			glyphs[i].top = -metrics->y_max;
+			glyphs[i].bottom = -metrics->y_min;
+		} else {
+			glyphs[i].left = glyphs[i].right = pen.x;
+			glyphs[i].top = glyphs[i].bottom = 0;
+		}
+		pen.x += metrics->x_advance;
+		pen.y += metrics->y_advance;
+	}
+
+	return pen;
+}
+
+/*
+ * Draw the text in the slot, returning its advance.
+ * The characters it has in common with the previous text at its start and,
+ * when both are as long, at its end stay on the drawable. Only the span
+ * in between is cleared with the background and drawn, along with the
+ * characters next to it whose ink reaches in there.
+ * Meant for horizontal text.
+ */
+FT_Vector
+xcbft_text_slot_update(struct xcbft_text_slot *slot, struct utf_holder text)
+{
+	unsigned int i, prefix, suffix, old_end, new_end;
+	int x0, x1, top, bottom;
+	bool moved;
+	struct xcbft_slot_glyph *glyphs;
+	struct xcbft_text_run run;
+	xcb_rectangle_t rectangle;
+	struct xcbft_context *ctx = slot->ctx;
+	struct xcbft_font *font = slot->faces.faces[0];
+	FT_Vector advance;
+
+	glyphs = malloc(sizeof(struct xcbft_slot_glyph) *
+		(text.length ? text.length : 1));
+	advance = xcbft_text_slot_layout(ctx, slot->faces, text, glyphs);
+
+	// what stays, the start is always at the same place and the end
+	// only when the texts are as long
+	prefix = suffix = 0;
+	if (slot->drawn) {
+		while (prefix < text.length && prefix < slot->length &&
+			text.str[prefix] == slot->text[prefix]) {
+			prefix++;
+		}
+		if (advance.x == slot->advance.x) {
+			while (suffix < text.length-prefix &&
+				suffix < slot->length-prefix &&
+				text.str[text.length-suffix-1] ==
+				slot->text[slot->length-suffix-1]) {
+				suffix++;
+			}
+		}
+		if (prefix == text.length && prefix == slot->length) {
+			free(glyphs);
+			return advance;
+		}
+	}
+
+	// the span that changed with the ink of what was there and of what
+	// goes there, at least as high as the faces
+	xcbft_font_activate(font);
+	top = -font->face->size->metrics.ascender/64;
+	bottom = -font->face->size->metrics.descender/64;
+	old_end = slot->drawn ? slot->length-suffix : 0;
+	new_end = text.length-suffix;
+	x0 = prefix < text.length ? glyphs[prefix].pen : advance.x;
+	x1 = new_end < text.length ? glyphs[new_end].pen : advance.x;
+	if (slot->drawn) {
+		if (old_end < slot->length) {
+			x1 = XCBFT_MAX(x1, slot->glyphs[old_end].pen);
+		} else {
+			x1 = XCBFT_MAX(x1, slot->advance.x);
+		}
+		for (i = prefix; i < old_end; i++) {
+			x0 = XCBFT_MIN(x0, slot->glyphs[i].left);
+			x1 = XCBFT_MAX(x1, slot->glyphs[i].right);
+			top = XCBFT_MIN(top, slot->glyphs[i].top);
+			bottom = XCBFT_MAX(bottom, slot->glyphs[i].bottom);
+		}
+	}
+	for (i = prefix; i < new_end; i++) {
+		x0 = XCBFT_MIN(x0, glyphs[i].left);
+		x1 = XCBFT_MAX(x1, glyphs[i].right);
+		top = XCBFT_MIN(top, glyphs[i].top);
+		bottom = XCBFT_MAX(bottom, glyphs[i].bottom);
+	}
+
+	// the characters kept whose ink is cleared with the span are drawn
+	// again, along with all of their ink so that it isn't drawn twice
+	do {
+		moved = false;
+		for (i = 0; i < prefix; i++) {
+			if (glyphs[i].right > x0 && glyphs[i].right >
+				glyphs[i].left) {
+				break;
+			}
+		}
+		if (i < prefix) {
+			for (; prefix > i; prefix--) {
+				x0 = XCBFT_MIN(x0, glyphs[prefix-1].left);
+				top = XCBFT_MIN(top, glyphs[prefix-1].top);
+				bottom = XCBFT_MAX(bottom, glyphs[prefix-1].bottom);
+			}
+			moved = true;
+		}
+		for (i = text.length; i > new_end; i--) {
+			if (glyphs[i-1].left < x1 && glyphs[i-1].right >
+				glyphs[i-1].left) {
+				break;
+			}
+		}
+		if (i > new_end) {
+			for (; new_end < i; new_end++) {
+				x1 = XCBFT_MAX(x1, glyphs[new_end].right);
+				top = XCBFT_MIN(top, glyphs[new_end].top);
+				bottom = XCBFT_MAX(bottom, glyphs[new_end].bottom);
+			}
+			moved = true;
+		}
+	} while (moved);
+
+	if (slot->picture != XCB_NONE) {
+		if (x1 > x0 && bottom > top) {
+			rectangle.x = slot->x + x0;
+			rectangle.y = slot->y + top;
+			rectangle.width = x1-x0;
+			rectangle.height = bottom-top;
+			xcb_render_fill_rectangles(ctx->c,
+				XCB_RENDER_PICT_OP_SRC, slot->picture,
+				slot->bg, 1, &rectangle);
+		}
+		run.x = slot->x + (prefix < text.length ?
+			glyphs[prefix].pen : advance.x);
+		run.y = slot->y;
+		run.text.str = text.str+prefix;
+		run.text.length = new_end-prefix;
+		run.faces = slot->faces;
+		run.color = slot->fg;
+		xcbft_draw_runs_picture(ctx, slot->picture, &run, 1);
+	}
+
+	// remember it for the next time
+	if (text.length > slot->allocated) {
+		slot->allocated = text.length;
+		slot->text = realloc(slot->text,
+			sizeof(uint32_t)*slot->allocated);
+	}
+	if (text.length > 0) {
+		memcpy(slot->text, text.str, sizeof(uint32_t)*text.length);
+	}
+	free(slot->glyphs);
+	slot->glyphs = glyphs;
+	slot->length = text.length;
+	slot->advance = advance;
+	slot->drawn = true;
+
+	return advance;
+}
+
+/*
+ * Find the picture of the drawable, creating it the first time with the
+ * format of the window visual or of the pixmap depth.
+ * Knowing the drawable costs one round trip, done once per drawable.
+ * Returns XCB_NONE if the drawable doesn't exist or has no render format.
+ */
+xcb_render_picture_t
+xcbft_get_picture(struct xcbft_context *ctx, xcb_drawable_t drawable)
+{
+	unsigned int i;
+	xcb_render_pictformat_t format;
+	xcb_get_geometry_cookie_t geometry_cookie;
+	xcb_get_window_attributes_cookie_t attributes_cookie;
+	xcb_get_geometry_reply_t *geometry;
+	xcb_get_window_attributes_reply_t *attributes;
+	xcb_generic_error_t *error;
+	struct xcbft_picture_cache *cache = &ctx->pictures;
+
+	for (i = 0; i < cache->length; i++) {
+		if (cache->pictures[i].drawable == drawable) {
+			return cache->pictures[i].picture;
+		}
+	}
+
+	// both at once, the attributes fail if it is a pixmap
+	geometry_cookie = xcb_get_geometry(ctx->c, drawable);
+	attributes_cookie = xcb_get_window_attributes(ctx->c, drawable);
+
+	attributes = xcb_get_window_attributes_reply(ctx->c,
+		attributes_cookie, &error);
+	free(error);
+	geometry = xcb_get_geometry_reply(ctx->c, geometry_cookie, &error);
+	if (geometry == NULL) {
+		fprintf(stderr, "could not get the geometry of drawable %u\n",
+			drawable);
+		free(error);
+		free(attributes);
+		return XCB_NONE;
+	}
+
+	if (attributes != NULL) {
+		format = xcbft_format_for_visual(ctx, attributes->visual);
+	} else {
+		format = xcbft_format_for_depth(ctx, geometry->depth);
+	}
+	free(attributes);
+
+	if (format == XCB_NONE) {
+		fprintf(stderr, "no render format for drawable %u of depth %d\n",
+			drawable, geometry->depth);
+		free(geometry);
+		return XCB_NONE;
+	}
+	free(geometry);
+
+	return xcbft_add_picture(ctx, drawable, format);
+}
+
+/*
+ * Create the picture of a drawable whose format is known and keep it with
+ * the others.
+ */
+static xcb_render_picture_t
+xcbft_add_picture(struct xcbft_context *ctx, xcb_drawable_t drawable,
+	xcb_render_pictformat_t format)
+{
+	uint32_t values[2];
+	xcb_render_picture_t picture;
+	struct xcbft_picture_cache *cache = &ctx->pictures;
+
+	// create the picture with its attribute and format
+	// not checked to avoid a round trip, the errors come back
+	// asynchronously through xcbft_handle_error
+	picture = xcb_generate_id(ctx->c);
+	values[0] = XCB_RENDER_POLY_MODE_IMPRECISE;
+	values[1] = XCB_RENDER_POLY_EDGE_SMOOTH;
+	xcb_render_create_picture(ctx->c,
+		picture, // pid
+		drawable, // drawable from the user
+		format, // format
+		XCB_RENDER_CP_POLY_MODE|XCB_RENDER_CP_POLY_EDGE,
+		values); // make it smooth
+
+	if (cache->length + 1 > cache->allocated) {
+		cache->allocated += 5;
+		cache->pictures = realloc(cache->pictures,
+			sizeof(struct xcbft_drawable_picture) * cache->allocated);
+	}
+	cache->pictures[cache->length].drawable = drawable;
+	cache->pictures[cache->length].picture = picture;
+	cache->length++;
+
+	return picture;
+}
+
+/*
+ * Free the picture kept for the drawable, to be called when the drawable
+ * is destroyed.
+ */
+void
+xcbft_invalidate_drawable(struct xcbft_context *ctx, xcb_drawable_t drawable)
+{
+	unsigned int i;
+	struct xcbft_picture_cache *cache = &ctx->pictures;
+
+	// a text pixmap freed by the application instead of given back
+	xcbft_pixmap_pool_forget(ctx, drawable);
+
+	for (i = 0; i < cache->length; i++) {
+		if (cache->pictures[i].drawable == drawable) {
+			xcb_render_free_picture(ctx->c,
+				cache->pictures[i].picture);
+			cache->pictures[i] = cache->pictures[cache->length-1];
+			cache->length--;
+			return;
+		}
+	}
+}
+
+/*
+ * Create a picture filled with the color everywhere, to be freed by the
+ * caller.
+ */
+xcb_render_picture_t
+xcbft_create_pen(struct xcbft_context *ctx, xcb_render_color_t color)
+{
+	xcb_render_picture_t picture = xcb_generate_id(ctx->c);
+
+	xcb_render_create_solid_fill(ctx->c, picture, color);
+
+	return picture;
+}
+
+/*
+ * Same as xcbft_create_pen but the picture is owned by the context and
+ * reused for the next draws with the same color, don't free it.
+ */
+xcb_render_picture_t
+xcbft_get_pen(struct xcbft_context *ctx, xcb_render_color_t color)
+{
+	unsigned int i, oldest;
+	struct xcbft_pen_cache *cache = &ctx->pens;
+	struct xcbft_pen *pen;
+
+	cache->clock++;
+	oldest = 0;
+	for (i = 0; i < cache->length; i++) {
+		pen = &cache->pens[i];
+		if (pen->color.red == color.red &&
+			pen->color.green == color.green &&
+			pen->color.blue == color.blue &&
+			pen->color.alpha == color.alpha) {
+			pen->last_used = cache->clock;
+			return pen->picture;
+		}
+		if (pen->last_used < cache->pens[oldest].last_used) {
+			oldest = i;
+		}
+	}
+
+	if (cache->length < XCBFT_PEN_CACHE_LENGTH) {
+		pen = &cache->pens[cache->length];
+		cache->length++;
+	} else {
+		pen = &cache->pens[oldest];
+		xcb_render_free_picture(ctx->c, pen->picture);
+	}
+
+	pen->color = color;
+	pen->picture = xcbft_create_pen(ctx, color);
+	pen->last_used = cache->clock;
+
+	return pen->picture;
+}
+
+static struct xcbft_glyph *
+xcbft_glyph_table_get(struct xcbft_glyph_table *table, uint32_t index)
+{
+	unsigned int i;
+
+	if (table->allocated == 0) {
+		return NULL;
+	}
+	i = (index * 2654435761u) & (table->allocated-1);
+	while (table->used[i]) {
+		if (table->indexes[i] == index) {
+			return &table->glyphs[i];
+		}
+		i = (i+1) & (table->allocated-1);
+	}
+	return NULL;
+}
+
+static void
+xcbft_glyph_table_put(struct xcbft_glyph_table *table, uint32_t index,
+	struct xcbft_glyph glyph)
+{
+	unsigned int i;
+	struct xcbft_glyph_table grown;
+
+	// keep the load factor under 1/2, rehashing in a table twice as big
+	if ((table->length+1)*2 > table->allocated) {
+		grown.allocated = table->allocated ? table->allocated*2 : 64;
+		grown.length = 0;
+		grown.indexes = malloc(sizeof(uint32_t)*grown.allocated);
+		grown.glyphs = malloc(
+			sizeof(struct xcbft_glyph)*grown.allocated);
+		grown.used = calloc(grown.allocated, sizeof(uint8_t));
+		for (i = 0; i < table->allocated; i++) {
+			if (table->used[i]) {
+				xcbft_glyph_table_put(&grown,
+					table->indexes[i], table->glyphs[i]);
+			}
+		}
+		xcbft_glyph_table_destroy(table);
+		*table = grown;
+	}
+
+	i = (index * 2654435761u) & (table->allocated-1);
+	while (table->used[i]) {
+		if (table->indexes[i] == index) {
+			table->glyphs[i] = glyph;
+			return;
+		}
+		i = (i+1) & (table->allocated-1);
+	}
+	table->used[i] = 1;
+	table->indexes[i] = index;
+	table->glyphs[i] = glyph;
+	table->length++;
+}
+
+static void
+xcbft_glyph_table_destroy(struct xcbft_glyph_table *table)
+{
+	free(table->indexes);
+	free(table->glyphs);
+	free(table->used);
+	table->indexes = NULL;
+	table->glyphs = NULL;
+	table->used = NULL;
+	table->length = table->allocated = 0;
+}
+
+struct xcbft_glyph_cache *
+xcbft_glyph_cache_create(struct xcbft_context *ctx)
+{
+	struct xcbft_glyph_cache *cache;
+
+	cache = calloc(1, sizeof(struct xcbft_glyph_cache));
+	if (cache == NULL) {
+		perror(NULL);
+		return NULL;
+	}
+	cache->c = ctx->c;
+	cache->format = ctx->format_a8;
+	cache->max_request_length = ctx->max_request_length;
+
+	return cache;
+}
+
+void
+xcbft_glyph_cache_destroy(struct xcbft_glyph_cache *cache)
+{
+	unsigned int i;
+
+	if (cache == NULL) {
+		return;
+	}
+	for (i = 0; i < cache->length; i++) {
+		xcbft_glyph_table_destroy(&cache->entries[i].glyphs);
+	}
+	free(cache->entries);
+	for (i = 0; i < cache->sets_length; i++) {
+		xcb_render_free_glyph_set(cache->c, cache->sets[i].glyphset);
+		free(cache->sets[i].free_ids);
+		xcbft_glyph_batch_destroy(&cache->sets[i].batch);
+	}
+	free(cache->sets);
+	free(cache);
+}
+
+/*
+ * Free the glyphs of a font that is about to be destroyed, their ids are
+ * given to the next glyphs.
+ */
+static void
+xcbft_glyph_cache_forget_font(struct xcbft_glyph_cache *cache,
+	struct xcbft_font *font)
+{
+	unsigned int i, j, k, first, count;
+	struct xcbft_font_glyphs *entry;
+	struct xcbft_glyphset *set;
+
+	// the glyphs freed must have been added before
+	xcbft_glyph_cache_upload(cache);
+
+	for (i = 0; i < cache->length; ) {
+		entry = &cache->entries[i];
+		if (entry->font != font) {
+			i++;
+			continue;
+		}
+		// the ids go to the free list of their glyphset, from where
+		// they are freed together
+		for (k = 0; k < cache->sets_length; k++) {
+			set = &cache->sets[k];
+			first = set->free_length;
+			for (j = 0; j < entry->glyphs.allocated; j++) {
+				if (!entry->glyphs.used[j] ||
+					entry->glyphs.glyphs[j].set != k) {
+					continue;
+				}
+				if (set->free_length + 1 > set->free_allocated) {
+					set->free_allocated = set->free_allocated ?
+						set->free_allocated*2 : 64;
+					set->free_ids = realloc(set->free_ids,
+						sizeof(uint32_t)*set->free_allocated);
+				}
+				set->free_ids[set->free_length] =
+					entry->glyphs.glyphs[j].id;
+				set->free_length++;
+			}
+			// FreeGlyphs: 8 bytes of header and 4 per glyph
+			for (j = first; j < set->free_length; j += count) {
+				count = set->free_length-j;
+				if (8+4*count > cache->max_request_length) {
+					count = (cache->max_request_length-8)/4;
+				}
+				xcb_render_free_glyphs(cache->c, set->glyphset,
+					count, set->free_ids+j);
+			}
+		}
+		xcbft_glyph_table_destroy(&entry->glyphs);
+		cache->entries[i] = cache->entries[cache->length-1];
+		cache->length--;
+	}
+}
+
+/*
+ * Find the glyphs of the font, start them if it isn't there yet.
+ */
+struct xcbft_font_glyphs *
+xcbft_glyph_cache_get_font(struct xcbft_glyph_cache *cache,
+	struct xcbft_font *font, FT_Int32 load_flags)
+{
+	unsigned int i;
+	struct xcbft_font_glyphs *entry;
+
+	for (i = 0; i < cache->length; i++) {
+		entry = &cache->entries[i];
+		if (entry->font == font && entry->load_flags == load_flags) {
+			return entry;
+		}
+	}
+
+	if (cache->length + 1 > cache->allocated) {
+		cache->allocated += 5;
+		cache->entries = realloc(cache->entries,
+			sizeof(struct xcbft_font_glyphs) * cache->allocated);
+	}
+	entry = &cache->entries[cache->length];
+	memset(entry, 0, sizeof(struct xcbft_font_glyphs));
+	entry->font = font;
+	entry->load_flags = load_flags;
+	entry->raster_font = xcbft_raster_font_id(font, load_flags,
+		&entry->disk_key);
+	cache->length++;
+
+	return entry;
+}
+
+/*
+ * Give the smallest id available in the glyphsets, the first one that
+ * isn't full is used and a new one is created when they all are.
+ * Returns the index of the glyphset.
+ */
+static unsigned int
+xcbft_glyph_cache_new_id(struct xcbft_glyph_cache *cache, uint32_t *id)
+{
+	unsigned int i;
+	struct xcbft_glyphset *set;
+
+	for (i = 0; i < cache->sets_length; i++) {
+		set = &cache->sets[i];
+		if (set->free_length > 0) {
+			set->free_length--;
+			*id = set->free_ids[set->free_length];
+			return i;
+		}
+		if (set->next_id < XCBFT_GLYPHSET_IDS) {
+			*id = set->next_id;
+			set->next_id++;
+			return i;
+		}
+	}
+
+	cache->sets = realloc(cache->sets,
+		sizeof(struct xcbft_glyphset) * (cache->sets_length+1));
+	set = &cache->sets[cache->sets_length];
+	memset(set, 0, sizeof(struct xcbft_glyphset));
+	set->glyphset = xcb_generate_id(cache->c);
+	xcb_render_create_glyph_set(cache->c, set->glyphset, cache->format);
+	cache->sets_length++;
+
+	*id = set->next_id;
+	set->next_id++;
+	return i;
+}
+
+/*
+ * Find a font supporting the character, from the fallbacks resolved for
+ * the text or by asking fontconfig for this character alone.
+ * The face resolved for a codepoint is remembered so that fontconfig is
+ * queried at most once per codepoint, even when nothing supports it.
+ * The fallback is at the size of the first face, they are kept in the
+ * context.
+ * Returns NULL if none could be found.
+ */
+static struct xcbft_font *
+xcbft_get_fallback(struct xcbft_context *ctx, FcChar32 character,
+	struct xcbft_face_holder faces)
+{
+	struct xcbft_face_entry *entry = NULL;
+	struct xcbft_face_cache *cache = &ctx->faces;
+
+	if (!xcbft_fallback_map_get(&cache->resolved, character, &entry)) {
+		xcbft_resolve_fallbacks(ctx, faces, &character, 1);
+		xcbft_fallback_map_get(&cache->resolved, character, &entry);
+	}
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	return xcbft_fallback_font(ctx, entry->file, entry->index,
+		faces.faces[0]->char_size, faces.faces[0]->load_flags);
+}
+
+/*
+ * Resolve the fallback of all the codepoints at once, with a single sorted
+ * list of fonts covering them that looks like the first face.
+ * The codepoints that were resolved before are skipped, the face of the
+ * others goes in the map of the context, NULL when nothing has them.
+ */
+static void
+xcbft_resolve_fallbacks(struct xcbft_context *ctx,
+	struct xcbft_face_holder faces, const uint32_t *codepoints,
+	unsigned int length)
+{
+	unsigned int i;
+	int j;
+	FcBool status;
+	FcResult result;
+	FcCharSet *missing, *charset;
+	FcPattern *pattern;
+	FcFontSet *chain;
+	FcChar8 *file;
+	int index;
+	struct xcbft_face_entry *entry;
+	struct xcbft_font *font;
+	// the fonts of the chain already opened, by position in the chain
+	struct xcbft_font **opened;
+	struct xcbft_face_cache *cache = &ctx->faces;
+
+	missing = FcCharSetCreate();
+	for (i = 0; i < length; i++) {
+		if (!xcbft_fallback_map_get(&cache->resolved, codepoints[i],
+			&entry)) {
+			FcCharSetAddChar(missing, codepoints[i]);
+		}
+	}
+	if (FcCharSetCount(missing) == 0) {
+		FcCharSetDestroy(missing);
+		return;
+	}
+
+	if (faces.coverage != NULL && faces.coverage->style != NULL) {
+		pattern = FcPatternDuplicate(faces.coverage->style);
+	} else {
+		pattern = FcPatternCreate();
+	}
+	FcPatternAddCharSet(pattern, FC_CHARSET, missing);
+	// also force it to be scalable
+	FcPatternAddBool(pattern, FC_SCALABLE, FcTrue);
+
+	// default & config substitutions, the usual
+	status = FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+	FcDefaultSubstitute(pattern);
+
+	// the fonts that add coverage for the missing characters, best first
+	chain = NULL;
+	if (status == FcFalse) {
+		fprintf(stderr, "could not perform config font substitution");
+	} else {
+		chain = FcFontSort(NULL, pattern, FcTrue, NULL, &result);
+	}
+	FcPatternDestroy(pattern);
+
+	opened = calloc(chain != NULL && chain->nfont > 0 ? chain->nfont : 1,
+		sizeof(struct xcbft_font *));
+
+	for (i = 0; i < length; i++) {
+		if (!FcCharSetHasChar(missing, codepoints[i])) {
+			continue;
+		}
+		// only once per codepoint
+		FcCharSetDelChar(missing, codepoints[i]);
+
+		font = NULL;
+		for (j = 0; chain != NULL && j < chain->nfont; j++) {
+			result = FcPatternGetCharSet(chain->fonts[j], FC_CHARSET,
+				0, &charset);
+			if (result != FcResultMatch ||
+				!FcCharSetHasChar(charset, codepoints[i])) {
+				continue;
+			}
+			if (opened[j] == NULL) {
+				if (FcPatternGetString(chain->fonts[j], FC_FILE,
+					0, &file) != FcResultMatch) {
+					continue;
+				}
+				if (FcPatternGetInteger(chain->fonts[j], FC_INDEX,
+					0, &index) != FcResultMatch) {
+					index = 0;
+				}
+				opened[j] = xcbft_fallback_font(ctx,
+					(const char *) file, index,
+					faces.faces[0]->char_size,
+					faces.faces[0]->load_flags);
+			}
+			font = opened[j];
+			if (font != NULL) {
+				break;
+			}
+		}
+		xcbft_fallback_map_put(&cache->resolved, codepoints[i],
+			font != NULL ? font->entry : NULL);
+	}
+
+	free(opened);
+	if (chain != NULL) {
+		FcFontSetDestroy(chain);
+	}
+	FcCharSetDestroy(missing);
+}
+
+/*
+ * Get the fallback font of the file at that size, rasterized as the face it
+ * stands in for. It is kept in the context, which holds the only reference
+ * to it.
+ */
+static struct xcbft_font *
+xcbft_fallback_font(struct xcbft_context *ctx, const char *file, int index,
+	FT_F26Dot6 char_size, FT_Int32 load_flags)
+{
+	unsigned int i;
+	struct xcbft_font *font;
+	struct xcbft_face_cache *cache = &ctx->faces;
+
+	font = xcbft_font_get(ctx, file, index, char_size, NULL, load_flags);
+	if (font == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < cache->fallbacks_length; i++) {
+		if (cache->fallbacks[i] == font) {
+			// the context already has its reference
+			xcbft_font_release(ctx, font);
+			return font;
+		}
+	}
+
+	cache->fallbacks = realloc(cache->fallbacks,
+		sizeof(struct xcbft_font *)*(cache->fallbacks_length+1));
+	cache->fallbacks[cache->fallbacks_length] = font;
+	cache->fallbacks_length++;
+
+	return font;
+}
+
+/*
+ * Returns whether the codepoint was resolved before, the face being NULL
+ * when none supports it.
+ */
+static bool
+xcbft_fallback_map_get(struct xcbft_fallback_map *map, uint32_t codepoint,
+	struct xcbft_face_entry **entry)
+{
+	unsigned int i;
+
+	if (map->allocated == 0) {
+		return false;
+	}
+	i = (codepoint * 2654435761u) & (map->allocated-1);
+	while (map->used[i]) {
+		if (map->codepoints[i] == codepoint) {
+			*entry = map->entries[i];
+			return true;
+		}
+		i = (i+1) & (map->allocated-1);
+	}
+	return false;
+}
+
+static void
+xcbft_fallback_map_put(struct xcbft_fallback_map *map, uint32_t codepoint,
+	struct xcbft_face_entry *entry)
+{
+	unsigned int i;
+	struct xcbft_fallback_map grown;
+
+	// same open addressing as the glyph tables
+	if ((map->length+1)*2 > map->allocated) {
+		grown.allocated = map->allocated ? map->allocated*2 : 64;
+		grown.length = 0;
+		grown.codepoints = malloc(sizeof(uint32_t)*grown.allocated);
+		grown.entries = malloc(
+			sizeof(struct xcbft_face_entry *)*grown.allocated);
+		grown.used = calloc(grown.allocated, sizeof(uint8_t));
+		for (i = 0; i < map->allocated; i++) {
+			if (map->used[i]) {
+				xcbft_fallback_map_put(&grown,
+					map->codepoints[i], map->entries[i]);
+			}
+		}
+		xcbft_fallback_map_destroy(map);
+		*map = grown;
+	}
+
+	i = (codepoint * 2654435761u) & (map->allocated-1);
+	while (map->used[i]) {
+		if (map->codepoints[i] == codepoint) {
+			map->entries[i] = entry;
+			return;
+		}
+		i = (i+1) & (map->allocated-1);
+	}
+	map->used[i] = 1;
+	map->codepoints[i] = codepoint;
+	map->entries[i] = entry;
+	map->length++;
+}
+
+static void
+xcbft_fallback_map_destroy(struct xcbft_fallback_map *map)
+{
+	free(map->codepoints);
+	free(map->entries);
+	free(map->used);
+	map->codepoints = NULL;
+	map->entries = NULL;
+	map->used = NULL;
+	map->length = map->allocated = 0;
+}
+
+/*
+ * The font of the face of the holder, opened from its reference the first
+ * time. NULL if it couldn't be opened.
+ */
+static struct xcbft_font *
+xcbft_holder_font(struct xcbft_context *ctx, struct xcbft_face_holder faces,
+	unsigned int i)
+{
+	struct xcbft_face_ref *ref;
+
+	if (faces.faces[i] != NULL || faces.refs == NULL) {
+		return faces.faces[i];
+	}
+	ref = &faces.refs[i];
+	if (ref->failed) {
+		return NULL;
+	}
+	faces.faces[i] = xcbft_font_get(ctx, ref->file, ref->index,
+		ref->char_size, ref->has_matrix ? &ref->matrix : NULL,
+		ref->load_flags);
+	ref->failed = faces.faces[i] == NULL;
+
+	return faces.faces[i];
+}
+
+/*
+ * The glyph index of the codepoint in the face of the holder, 0 when it
+ * doesn't have it. A face that isn't opened yet is only opened if the
+ * charset of its pattern has the codepoint.
+ */
+static uint32_t
+xcbft_holder_char_index(struct xcbft_context *ctx,
+	struct xcbft_face_holder faces, unsigned int i, uint32_t codepoint)
+{
+	struct xcbft_font *font;
+
+	if (faces.faces[i] == NULL && faces.refs != NULL &&
+		faces.refs[i].charset != NULL &&
+		!FcCharSetHasChar(faces.refs[i].charset, codepoint)) {
+		return 0;
+	}
+	font = xcbft_holder_font(ctx, faces, i);
+	if (font == NULL) {
+		return 0;
+	}
+	return FT_Get_Char_Index(font->face, codepoint);
+}
+
+/*
+ * The slot of the codepoint in the coverage, the one given is used for
+ * codepoints outside of unicode which are looked up every time.
+ */
+static struct xcbft_coverage_slot *
+xcbft_coverage_slot(struct xcbft_face_holder faces, uint32_t codepoint,
+	struct xcbft_coverage_slot *uncached)
+{
+	struct xcbft_coverage *coverage = faces.coverage;
+	struct xcbft_coverage_slot **page;
+
+	if (codepoint < 256) {
+		return &coverage->latin1[codepoint];
+	} else if (codepoint < 0x110000) {
+		page = &coverage->pages[codepoint >> 8];
+		if (*page == NULL) {
+			*page = calloc(256, sizeof(struct xcbft_coverage_slot));
+		}
+		return &(*page)[codepoint & 0xff];
+	}
+	uncached->face = 0;
+	return uncached;
+}
+
+/*
+ * Find the font and glyph index for the codepoint, from the faces of the
+ * holder in order then the fallbacks.
+ * The result is kept in the coverage of the holder so that the charmaps
+ * are only looked at the first time.
+ */
+static struct xcbft_font *
+xcbft_coverage_lookup(struct xcbft_context *ctx,
+	struct xcbft_face_holder faces, uint32_t codepoint,
+	uint32_t *glyph_index)
+{
+	unsigned int i;
+	struct xcbft_coverage *coverage = faces.coverage;
+	struct xcbft_coverage_slot *slot, uncached;
+	struct xcbft_font *font;
+
+	slot = xcbft_coverage_slot(faces, codepoint, &uncached);
+	if (slot->face == 0) {
+		for (i = 0; i < faces.length; i++) {
+			slot->glyph_index = xcbft_holder_char_index(ctx, faces,
+				i, codepoint);
+			if (slot->glyph_index != 0) {
+				slot->face = i+1;
+				break;
+			}
+		}
+	}
+	if (slot->face == 0) {
+		// fallback, at the size of the first face
+		font = xcbft_get_fallback(ctx, codepoint, faces);
+		if (font == NULL) {
+			fprintf(stderr,
+				"No faces found supporting character: %02x\n",
+				codepoint);
+			// draw a block using whatever font
+			slot->face = 1;
+			slot->glyph_index = 0;
+		} else {
+			for (i = 0; i < coverage->fallbacks_length; i++) {
+				if (coverage->fallbacks[i] == font) {
+					break;
+				}
+			}
+			if (i == coverage->fallbacks_length) {
+				coverage->fallbacks = realloc(
+					coverage->fallbacks,
+					sizeof(struct xcbft_font *)*(i+1));
+				coverage->fallbacks[i] = font;
+				coverage->fallbacks_length++;
+			}
+			slot->face = faces.length+i+1;
+			slot->glyph_index = FT_Get_Char_Index(font->face,
+				codepoint);
+		}
+	}
+
+	*glyph_index = slot->glyph_index;
+	if (slot->face <= faces.length) {
+		return faces.faces[slot->face-1];
+	}
+	// the fallbacks are kept alive by the context
+	return coverage->fallbacks[slot->face-faces.length-1];
+}
+
+/*
+ * Look the characters of the text up in the faces, gathering the ones none
+ * of them have so that their fallbacks are found with a single query for
+ * the whole text.
+ */
+static void
+xcbft_coverage_prepare(struct xcbft_context *ctx,
+	struct xcbft_face_holder faces, struct utf_holder text)
+{
+	unsigned int i, j, missing;
+	uint32_t *codepoints = NULL;
+	struct xcbft_coverage_slot *slot, uncached;
+
+	missing = 0;
+	for (i = 0; i < text.length; i++) {
+		slot = xcbft_coverage_slot(faces, text.str[i], &uncached);
+		if (slot->face != 0) {
+			continue;
+		}
+		for (j = 0; j < faces.length; j++) {
+			slot->glyph_index = xcbft_holder_char_index(ctx, faces,
+				j, text.str[i]);
+			if (slot->glyph_index != 0) {
+				slot->face = j+1;
+				break;
+			}
+		}
+		if (slot->face == 0) {
+			if (codepoints == NULL) {
+				codepoints = malloc(
+					sizeof(uint32_t)*(text.length-i));
+			}
+			codepoints[missing] = text.str[i];
+			missing++;
+		}
+	}
+	if (missing > 0) {
+		xcbft_resolve_fallbacks(ctx, faces, codepoints, missing);
+	}
+	free(codepoints);
+}
+
+static void
+xcbft_coverage_destroy(struct xcbft_coverage *coverage)
+{
+	unsigned int i;
+
+	for (i = 0; i < XCBFT_COVERAGE_PAGES; i++) {
+		free(coverage->pages[i]);
+	}
+	free(coverage->fallbacks);
+	if (coverage->style != NULL) {
+		FcPatternDestroy(coverage->style);
+	}
+	free(coverage);
+}
+
+struct xcbft_glyphset_and_advance
+xcbft_load_glyphset(
+	struct xcbft_context *ctx,
+	struct xcbft_face_holder faces,
+	struct utf_holder text)
+{
+	struct xcbft_glyphset_and_advance glyphset_advance;
+
+	glyphset_advance = xcbft_stage_glyphset(ctx, faces, text);
+	// send everything that was staged while going over the text
+	xcbft_glyph_cache_upload(ctx->glyph_cache);
+
+	return glyphset_advance;
+}
+
+/*
+ * Find the glyphs of the text, the ones that weren't uploaded yet are
+ * rasterized and staged for xcbft_glyph_cache_upload.
+ */
+static struct xcbft_glyphset_and_advance
+xcbft_stage_glyphset(
+	struct xcbft_context *ctx,
+	struct xcbft_face_holder faces,
+	struct utf_holder text)
+{
+	struct xcbft_glyph_cache *cache = ctx->glyph_cache;
+	unsigned int i;
+	uint32_t *glyph_indexes;
+	struct xcbft_font **fonts;
+	struct xcbft_font_glyphs *entry;
+	const struct xcbft_glyph *glyph;
+	FT_Vector total_advance;
+	struct xcbft_glyphset_and_advance glyphset_advance;
+
+	total_advance.x = total_advance.y = 0;
+	glyphset_advance.max_glyph = 0;
+	glyphset_advance.glyphsets = malloc(
+		sizeof(xcb_render_glyphset_t)*(text.length ? text.length : 1));
+	glyphset_advance.glyphs = malloc(
+		sizeof(uint32_t)*(text.length ? text.length : 1));
+	fonts = malloc(
+		sizeof(struct xcbft_font *)*(text.length ? text.length : 1));
+	glyph_indexes = malloc(
+		sizeof(uint32_t)*(text.length ? text.length : 1));
+
+	xcbft_coverage_prepare(ctx, faces, text);
+
+	// the face and glyph were resolved the first time the character was
+	// drawn with these faces
+	for (i = 0; i < text.length; i++) {
+		fonts[i] = xcbft_coverage_lookup(ctx, faces, text.str[i],
+			&glyph_indexes[i]);
+		if (ctx->usage != NULL && text.str[i] < 0x110000) {
+			ctx->usage[text.str[i] >> 3] |= 1 << (text.str[i] & 7);
+		}
+	}
+	if (ctx->workers != NULL) {
+		// what was prewarmed goes first
+		xcbft_prewarm_collect(ctx);
+		xcbft_rasterize_parallel(ctx, fonts, glyph_indexes,
+			text.length);
+	}
+
+	for (i = 0; i < text.length; i++) {
+		entry = xcbft_glyph_cache_get_font(cache, fonts[i],
+			fonts[i]->load_flags);
+		glyph = xcbft_load_glyph(cache, entry, glyph_indexes[i]);
+		total_advance.x += glyph->info.x_off;
+		total_advance.y += glyph->info.y_off;
+		glyphset_advance.glyphsets[i] =
+			cache->sets[glyph->set].glyphset;
+		glyphset_advance.glyphs[i] = glyph->id;
+		if (glyph->id > glyphset_advance.max_glyph) {
+			glyphset_advance.max_glyph = glyph->id;
+		}
+	}
+	free(fonts);
+	free(glyph_indexes);
+
+	glyphset_advance.advance = total_advance;
+	return glyphset_advance;
+}
+
+/*
+ * Stage the glyph of the font for upload to a glyphset with the next id
+ * available, unless it is already there. It is rasterized unless the
+ * raster cache already has it.
+ * The staged glyphs are sent by xcbft_glyph_cache_upload.
+ */
+const struct xcbft_glyph *
+xcbft_load_glyph(
+	struct xcbft_glyph_cache *cache, struct xcbft_font_glyphs *entry,
+	uint32_t glyph_index)
+{
+	struct xcbft_glyph glyph, *cached;
+	xcb_render_glyphinfo_t ginfo;
+	const struct xcbft_raster *raster;
+	struct xcbft_glyph_batch *batch;
+	size_t size, request_length;
+
+	cached = xcbft_glyph_table_get(&entry->glyphs, glyph_index);
+	if (cached != NULL) {
+		return cached;
+	}
+
+	// held until the raster is copied to the batch
+	pthread_mutex_lock(&xcbft_rasters.lock);
+	raster = xcbft_raster_get(entry, glyph_index);
+	ginfo = raster->info;
+	size = raster->size;
+
+	// AddGlyphs: 12 bytes of header, then 4 bytes of id and 12 bytes of
+	// glyphinfo per glyph, followed by the data
+	request_length = 12 + 16 + size;
+	if (request_length > cache->max_request_length) {
+		fprintf(stderr,
+			"glyph %02x is too big to be uploaded\n", glyph_index);
+		// only the advance then, not tried again
+		ginfo.width = ginfo.height = 0;
+		size = 0;
+		request_length = 12 + 16;
+	}
+
+	// remember it right away so that it is only staged once per text
+	glyph.info = ginfo;
+	glyph.set = xcbft_glyph_cache_new_id(cache, &glyph.id);
+	xcbft_glyph_table_put(&entry->glyphs, glyph_index, glyph);
+
+	// send what is already staged if this glyph doesn't fit with it
+	batch = &cache->sets[glyph.set].batch;
+	request_length += 16*batch->length + batch->data_length;
+	if (request_length > cache->max_request_length) {
+		xcbft_glyph_batch_send(cache, &cache->sets[glyph.set]);
+	}
+
+	if (batch->length + 1 > batch->allocated) {
+		batch->allocated = batch->allocated ? batch->allocated*2 : 32;
+		batch->ids = realloc(batch->ids,
+			sizeof(uint32_t)*batch->allocated);
+		batch->infos = realloc(batch->infos,
+			sizeof(xcb_render_glyphinfo_t)*batch->allocated);
+	}
+	if (batch->data_length + size > batch->data_allocated) {
+		batch->data_allocated = batch->data_allocated ?
+			batch->data_allocated*2 : 4096;
+		if (batch->data_length + size > batch->data_allocated) {
+			batch->data_allocated = batch->data_length + size;
+		}
+		batch->data = realloc(batch->data, batch->data_allocated);
+	}
+
+	batch->ids[batch->length] = glyph.id;
+	batch->infos[batch->length] = ginfo;
+	batch->length++;
+
+	// already padded as the request wants it
+	if (size > 0) {
+		memcpy(batch->data+batch->data_length, raster->data, size);
+	}
+	batch->data_length += size;
+	pthread_mutex_unlock(&xcbft_rasters.lock);
+
+	return xcbft_glyph_table_get(&entry->glyphs, glyph_index);
+}
+
+/*
+ * Id of the face, scale and flags of the font in the raster cache, the
+ * fonts of all the contexts rasterizing the same way share it.
+ */
+static uint32_t
+xcbft_raster_font_id(struct xcbft_font *font, FT_Int32 load_flags,
+	uint64_t *disk_key)
+{
+	unsigned int i;
+	struct xcbft_raster_font key, *known;
+	struct xcbft_raster_cache *cache = &xcbft_rasters;
+
+	memset(&key, 0, sizeof(struct xcbft_raster_font));
+	key.file = font->entry->file;
+	key.index = font->entry->index;
+	key.x_scale = font->size->metrics.x_scale;
+	key.y_scale = font->size->metrics.y_scale;
+	key.has_matrix = font->has_matrix;
+	if (font->has_matrix) {
+		key.matrix = font->matrix;
+	}
+	key.load_flags = load_flags;
+	key.disk_key = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < cache->fonts_length; i++) {
+		known = &cache->fonts[i];
+		if (known->index == key.index &&
+			known->x_scale == key.x_scale &&
+			known->y_scale == key.y_scale &&
+			known->load_flags == key.load_flags &&
+			known->has_matrix == key.has_matrix &&
+			known->matrix.xx == key.matrix.xx &&
+			known->matrix.xy == key.matrix.xy &&
+			known->matrix.yx == key.matrix.yx &&
+			known->matrix.yy == key.matrix.yy &&
+			strcmp(known->file, key.file) == 0) {
+			*disk_key = known->disk_key;
+			pthread_mutex_unlock(&cache->lock);
+			return i;
+		}
+	}
+
+	key.disk_key = xcbft_disk_key(&key);
+	*disk_key = key.disk_key;
+	key.file = strdup(key.file);
+	cache->fonts = realloc(cache->fonts,
+		sizeof(struct xcbft_raster_font)*(cache->fonts_length+1));
+	cache->fonts[cache->fonts_length] = key;
+	cache->fonts_length++;
+	i = cache->fonts_length-1;
+	pthread_mutex_unlock(&cache->lock);
+
+	return i;
+}
+
+static unsigned int
+xcbft_raster_bucket(uint32_t font, uint32_t glyph_index,
+	unsigned int buckets_length)
+{
+	return ((font << 16) ^ glyph_index) * 2654435761u &
+		(buckets_length-1);
+}
+
+/*
+ * The glyph as rasterized with the font and flags of the entry, from the
+ * cache or from FreeType the first time.
+ * Called with the lock of the raster cache held, it is released while
+ * rasterizing. The raster stays valid until the lock is released.
+ */
+static const struct xcbft_raster *
+xcbft_raster_get(struct xcbft_font_glyphs *entry, uint32_t glyph_index)
+{
+	bool from_disk;
+	FT_Face face = entry->font->face;
+	struct xcbft_raster *raster, *found;
+	struct xcbft_raster_cache *cache = &xcbft_rasters;
+
+	raster = xcbft_raster_find(entry->raster_font, glyph_index);
+	if (raster != NULL) {
+		if (raster->counted) {
+			raster->counted = false;
+		} else {
+			cache->stats.hits++;
+		}
+		xcbft_raster_touch(raster);
+		return raster;
+	}
+
+	// the other threads can use the cache meanwhile, the face is only
+	// used by this context
+	pthread_mutex_unlock(&cache->lock);
+	raster = xcbft_disk_cache_get(entry->disk_key, entry->raster_font,
+		glyph_index);
+	from_disk = raster != NULL;
+	if (!from_disk) {
+		xcbft_font_activate(entry->font);
+		FT_Load_Glyph(face, glyph_index, entry->load_flags);
+		raster = xcbft_raster_new(face->glyph, entry->raster_font,
+			glyph_index);
+		xcbft_disk_cache_put(entry->disk_key, raster);
+	}
+	pthread_mutex_lock(&cache->lock);
+
+	// another thread could have done the same
+	found = xcbft_raster_find(entry->raster_font, glyph_index);
+	if (found != NULL) {
+		free(raster);
+		cache->stats.hits++;
+		xcbft_raster_touch(found);
+		return found;
+	}
+	if (from_disk) {
+		cache->stats.disk_hits++;
+	} else {
+		cache->stats.misses++;
+	}
+	xcbft_raster_insert(raster);
+
+	return raster;
+}
+
+/*
+ * Make the raster the most recently used.
+ */
+static void
+xcbft_raster_touch(struct xcbft_raster *raster)
+{
+	struct xcbft_raster_cache *cache = &xcbft_rasters;
+
+	if (raster == cache->newest) {
+		return;
+	}
+	raster->newer->older = raster->older;
+	if (raster->older != NULL) {
+		raster->older->newer = raster->newer;
+	} else {
+		cache->oldest = raster->newer;
+	}
+	raster->older = cache->newest;
+	raster->newer = NULL;
+	cache->newest->newer = raster;
+	cache->newest = raster;
+}
+
+static struct xcbft_raster *
+xcbft_raster_find(uint32_t font, uint32_t glyph_index)
+{
+	unsigned int bucket;
+	struct xcbft_raster *raster;
+	struct xcbft_raster_cache *cache = &xcbft_rasters;
+
+	if (cache->buckets_length == 0) {
+		return NULL;
+	}
+	bucket = xcbft_raster_bucket(font, glyph_index,
+		cache->buckets_length);
+	for (raster = cache->buckets[bucket]; raster != NULL;
+		raster = raster->next) {
+		if (raster->font == font &&
+			raster->glyph_index == glyph_index) {
+			return raster;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Make a raster of the glyph loaded in the slot, it only allocates and
+ * copies so the workers can call it.
+ */
+static struct xcbft_raster *
+xcbft_raster_new(FT_GlyphSlot slot, uint32_t font, uint32_t glyph_index)
+{
+	size_t stride;
+	FT_Bitmap *bitmap = &slot->bitmap;
+	struct xcbft_raster *raster;
+
+	// the bitmap right after the raster, a single allocation
+	stride = (bitmap->width+3)&~3;
+	raster = malloc(sizeof(struct xcbft_raster) + stride*bitmap->rows);
+	memset(raster, 0, sizeof(struct xcbft_raster));
+	raster->data = (uint8_t *)(raster+1);
+	raster->size = stride*bitmap->rows;
+	raster->font = font;
+	raster->glyph_index = glyph_index;
+	raster->info.x = -slot->bitmap_left;
+	raster->info.y = slot->bitmap_top;
+	raster->info.width = bitmap->width;
+	raster->info.height = bitmap->rows;
+	raster->info.x_off = slot->advance.x/64;
+	raster->info.y_off = slot->advance.y/64;
+
+	if (bitmap->pixel_mode == FT_PIXEL_MODE_MONO) {
+		xcbft_expand_mono_rows(raster->data, stride, bitmap);
+	} else {
+		xcbft_repack_rows(raster->data, stride, bitmap);
+	}
+
+	return raster;
+}
+
+/*
+ * Keep the raster that was just rasterized as the most recently used,
+ * dropping the oldest ones if over the limit.
+ * Called with the lock of the raster cache held, as find and trim.
+ */
+static void
+xcbft_raster_insert(struct xcbft_raster *raster)
+{
+	unsigned int i, bucket, to;
+	struct xcbft_raster **grown, *moved, *next;
+	struct xcbft_raster_cache *cache = &xcbft_rasters;
+
+	// at most one raster per bucket on average
+	if (cache->stats.length+1 > cache->buckets_length) {
+		i = cache->buckets_length ? cache->buckets_length*2 : 256;
+		grown = calloc(i, sizeof(struct xcbft_raster *));
+		for (bucket = 0; bucket < cache->buckets_length; bucket++) {
+			for (moved = cache->buckets[bucket]; moved != NULL;
+				moved = next) {
+				next = moved->next;
+				to = xcbft_raster_bucket(moved->font,
+					moved->glyph_index, i);
+				moved->next = grown[to];
+				grown[to] = moved;
+			}
+		}
+		free(cache->buckets);
+		cache->buckets = grown;
+		cache->buckets_length = i;
+	}
+	bucket = xcbft_raster_bucket(raster->font, raster->glyph_index,
+		cache->buckets_length);
+	raster->next = cache->buckets[bucket];
+	cache->buckets[bucket] = raster;
+
+	raster->older = cache->newest;
+	if (cache->newest != NULL) {
+		cache->newest->newer = raster;
+	} else {
+		cache->oldest = raster;
+	}
+	cache->newest = raster;
+	cache->stats.length++;
+	cache->stats.size += sizeof(struct xcbft_raster) + raster->size;
+
+	xcbft_raster_cache_trim();
+}
+
+/*
+ * Use the raster cache file at the path, by default xcbft/rasters-1 in
+ * XDG_CACHE_HOME or ~/.cache, shared with the other processes using it.
+ * The glyphs found there aren't rasterized, the ones rasterized are added
+ * to it.
+ * Returns false if it couldn't be opened, the rasters are then only kept
+ * in memory.
+ */
+bool
+xcbft_disk_cache_open(const char *path)
+{
+	int fd;
+	char *home, *default_path = NULL, *slash;
+	char header[sizeof(XCBFT_DISK_CACHE_HEADER)-1];
+	struct stat st;
+	struct xcbft_disk_cache *disk = &xcbft_disk;
+
+	xcbft_disk_cache_close();
+
+	if (path == NULL) {
+		home = getenv("XDG_CACHE_HOME");
+		if (home != NULL && home[0] != '\0') {
+			default_path = malloc(strlen(home) + 32);
+			sprintf(default_path, "%s/xcbft/" XCBFT_DISK_CACHE_NAME,
+				home);
+		} else if ((home = getenv("HOME")) != NULL) {
+			default_path = malloc(strlen(home) + 32);
+			sprintf(default_path,
+				"%s/.cache/xcbft/" XCBFT_DISK_CACHE_NAME, home);
+		} else {
+			fprintf(stderr, "no cache directory for the rasters\n");
+			return false;
+		}
+		// the directories up to the file
+		for (slash = strchr(default_path+1, '/'); slash != NULL;
+			slash = strchr(slash+1, '/')) {
+			*slash = '\0';
+			mkdir(default_path, 0755);
+			*slash = '/';
+		}
+		path = default_path;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "could not open %s: %s\n", path,
+			strerror(errno));
+		free(default_path);
+		return false;
+	}
+
+	flock(fd, LOCK_EX);
+	if (fstat(fd, &st) != 0) {
+		fprintf(stderr, "could not stat %s: %s\n", path,
+			strerror(errno));
+		flock(fd, LOCK_UN);
+		close(fd);
+		fd = -1;
+	} else if (st.st_size == 0) {
+		// just created
+		if (pwrite(fd, XCBFT_DISK_CACHE_HEADER, sizeof(header), 0) !=
+			sizeof(header)) {
+			fprintf(stderr, "could not write %s: %s\n", path,
+				strerror(errno));
+			flock(fd, LOCK_UN);
+			close(fd);
+			fd = -1;
+		}
+	} else if ((size_t)st.st_size < sizeof(header) ||
+		pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+		memcmp(header, XCBFT_DISK_CACHE_HEADER, sizeof(header)) != 0) {
+		// another version, the processes that have it mapped keep it
+		fd = xcbft_disk_cache_replace(path, fd);
+	}
+	free(default_path);
+	if (fd < 0) {
+		return false;
+	}
+	pthread_mutex_lock(&disk->lock);
+	if (disk->fd >= 0) {
+		// another thread opened one meanwhile
+		pthread_mutex_unlock(&disk->lock);
+		flock(fd, LOCK_UN);
+		close(fd);
+		return true;
+	}
+	disk->fd = fd;
+	disk->indexed = sizeof(header);
+	xcbft_disk_cache_sync();
+	pthread_mutex_unlock(&disk->lock);
+	flock(fd, LOCK_UN);
+
+	return true;
+}
+
+/*
+ * Put a new file with only the header in place of the one at the path,
+ * which stays as it is for those using it.
+ * Returns the locked descriptor of the new file, -1 if it couldn't be made,
+ * the old one is closed either way.
+ */
+static int
+xcbft_disk_cache_replace(const char *path, int old)
+{
+	int fd;
+	size_t length = strlen(path) + 8;
+	char *temporary;
+
+	temporary = malloc(length);
+	snprintf(temporary, length, "%s.XXXXXX", path);
+	fd = mkstemp(temporary);
+	if (fd >= 0 && (
+		fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+		fchmod(fd, 0644) != 0 ||
+		pwrite(fd, XCBFT_DISK_CACHE_HEADER,
+		sizeof(XCBFT_DISK_CACHE_HEADER)-1, 0) !=
+		sizeof(XCBFT_DISK_CACHE_HEADER)-1 ||
+		rename(temporary, path) != 0)) {
+		unlink(temporary);
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		fprintf(stderr, "could not replace %s: %s\n", path,
+			strerror(errno));
+	} else {
+		flock(fd, LOCK_EX);
+	}
+	free(temporary);
+	flock(old, LOCK_UN);
+	close(old);
+
+	return fd;
+}
+
+/*
+ * Append what is pending and stop using the raster cache file.
+ */
+void
+xcbft_disk_cache_close(void)
+{
+	struct xcbft_disk_cache *disk = &xcbft_disk;
+
+	xcbft_disk_cache_flush();
+
+	pthread_mutex_lock(&disk->lock);
+	if (disk->fd < 0) {
+		pthread_mutex_unlock(&disk->lock);
+		return;
+	}
+	if (disk->map != NULL) {
+		munmap((void *)disk->map, disk->mapped);
+	}
+	close(disk->fd);
+	free(disk->fonts);
+	free(disk->glyphs);
+	free(disk->offsets);
+	free(disk->pending);
+	disk->fd = -1;
+	disk->map = NULL;
+	disk->mapped = disk->indexed = 0;
+	disk->fonts = NULL;
+	disk->glyphs = NULL;
+	disk->offsets = NULL;
+	disk->length = disk->allocated = 0;
+	disk->pending = NULL;
+	disk->pending_length = disk->pending_allocated = 0;
+	pthread_mutex_unlock(&disk->lock);
+}
+
+/*
+ * Hash of everything the rasters of the font depend on, the file being
+ * known by its path, size and modification time.
+ */
+static uint64_t
+xcbft_disk_key(const struct xcbft_raster_font *font)
+{
+	char identity[4096];
+	struct stat st;
+	uint64_t hash = 14695981039346656037ull;
+	int i, length;
+
+	if (stat(font->file, &st) != 0) {
+		memset(&st, 0, sizeof(struct stat));
+	}
+	length = snprintf(identity, sizeof(identity),
+		"%s\n%lld.%09ld %lld\n%d\n%ld %ld\n%d %ld %ld %ld %ld\n%x\n"
+		"freetype %d.%d.%d",
+		font->file, (long long)st.st_mtim.tv_sec,
+		(long)st.st_mtim.tv_nsec, (long long)st.st_size,
+		font->index, (long)font->x_scale, (long)font->y_scale,
+		font->has_matrix, (long)font->matrix.xx,
+		(long)font->matrix.xy, (long)font->matrix.yx,
+		(long)font->matrix.yy, (unsigned int)font->load_flags,
+		FREETYPE_MAJOR, FREETYPE_MINOR, FREETYPE_PATCH);
+	if (length >= (int)sizeof(identity)) {
+		length = sizeof(identity)-1;
+	}
+
+	// FNV-1a
+	for (i = 0; i < length; i++) {
+		hash ^= (uint8_t)identity[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+/*
+ * Map the file as it is now and index the records added since the last
+ * time, returning where the valid ones stop.
+ * The lock of the file is held, shared or exclusive, and the one of the
+ * disk cache.
+ */
+static size_t
+xcbft_disk_cache_sync(void)
+{
+	size_t end;
+	struct stat st;
+	struct xcbft_disk_record record;
+	struct xcbft_disk_cache *disk = &xcbft_disk;
+
+	if (fstat(disk->fd, &st) != 0) {
+		return disk->indexed;
+	}
+	if ((size_t)st.st_size > disk->mapped) {
+		if (disk->map != NULL) {
+			munmap((void *)disk->map, disk->mapped);
+		}
+		disk->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+			disk->fd, 0);
+		if (disk->map == MAP_FAILED) {
+			disk->map = NULL;
+			disk->mapped = 0;
+			return disk->indexed;
+		}
+		disk->mapped = st.st_size;
+	}
+
+	// a record cut short by a process that died stops the indexing
+	end = XCBFT_MIN((size_t)st.st_size, disk->mapped);
+	while (disk->indexed + sizeof(record) <= end) {
+		memcpy(&record, disk->map + disk->indexed, sizeof(record));
+		if (!xcbft_disk_record_valid(&record, disk->indexed, end)) {
+			break;
+		}
+		xcbft_disk_cache_index(record.font, record.glyph_index,
+			disk->indexed);
+		disk->indexed += sizeof(record) + record.size;
+	}
+
+	return disk->indexed;
+}
+
+/*
+ * Whether the record at the offset is whole before the end and its bitmap
+ * has the size of the glyph, 8 bits rows padded to 4 bytes.
+ */
+static bool
+xcbft_disk_record_valid(const struct xcbft_disk_record *record,
+	size_t offset, size_t end)
+{
+	if (record->magic != XCBFT_DISK_CACHE_MAGIC ||
+		offset + sizeof(struct xcbft_disk_record) > end ||
+		record->size > end - offset - sizeof(struct xcbft_disk_record)) {
+		return false;
+	}
+	return (size_t)record->size ==
+		(size_t)((record->info.width+3)&~3) * record->info.height;
+}
+
+static void
+xcbft_disk_cache_index(uint64_t font, uint32_t glyph_index, uint64_t offset)
+{
+	unsigned int i, j;
+	uint64_t *fonts, *offsets;
+	uint32_t *glyphs;
+	unsigned int allocated;
+	struct xcbft_disk_cache *disk = &xcbft_disk;
+
+	// keep the load factor under 1/2
+	if ((disk->length+1)*2 > disk->allocated) {
+		fonts = disk->fonts;
+		glyphs = disk->glyphs;
+		offsets = disk->offsets;
+		allocated = disk->allocated;
+		disk->allocated = allocated ? allocated*2 : 1024;
+		disk->fonts = malloc(sizeof(uint64_t)*disk->allocated);
+		disk->glyphs = malloc(sizeof(uint32_t)*disk->allocated);
+		disk->offsets = calloc(disk->allocated, sizeof(uint64_t));
+		disk->length = 0;
+		for (j = 0; j < allocated; j++) {
+			if (offsets[j] != 0) {
+				xcbft_disk_cache_index(fonts[j], glyphs[j],
+					offsets[j]);
+			}
+		}
+		free(fonts);
+		free(glyphs);
+		free(offsets);
+	}
+
+	i = ((uint32_t)(font ^ (font >> 32)) ^ glyph_index) * 2654435761u &
+		(disk->allocated-1);
+	while (disk->offsets[i] != 0) {
+		if (disk->fonts[i] == font && disk->glyphs[i] == glyph_index) {
+			// the first one is kept
+			return;
+		}
+		i = (i+1) & (disk->allocated-1);
+	}
+	disk->fonts[i] = font;
+	disk->glyphs[i] = glyph_index;
+	disk->offsets[i] = offset;
+	disk->length++;
+}
+
+static uint64_t
+xcbft_disk_cache_find(uint64_t font, uint32_t glyph_index)
+{
+	unsigned int i;
+	struct xcbft_disk_cache *disk = &xcbft_disk;
+
+	if (disk->allocated == 0) {
+		return 0;
+	}
+	i = ((uint32_t)(font ^ (font >> 32)) ^ glyph_index) * 2654435761u &
+		(disk->allocated-1);
+	while (disk->offsets[i] != 0) {
+		if (disk->fonts[i] == font && disk->glyphs[i] == glyph_index) {
+			return disk->offsets[i];
+		}
+		i = (i+1) & (disk->allocated-1);
+	}
+	return 0;
+}
+
+/*
+ * A copy of the raster of the font with that disk key from the file,
+ * looking at what the other processes added if it isn't indexed. NULL if
+ * the file doesn't have it.
+ */
+static struct xcbft_raster *
+xcbft_disk_cache_get(uint64_t font, uint32_t raster_font,
+	uint32_t glyph_index)
+{
+	uint64_t offset;
+	struct stat st;
+	struct xcbft_disk_record record;
+	struct xcbft_raster *raster;
+	struct xcbft_disk_cache *disk = &xcbft_disk;
+
+	pthread_mutex_lock(&disk->lock);
+	if (disk->fd < 0) {
+		pthread_mutex_unlock(&disk->lock);
+		return NULL;
+	}
+
+	offset = xcbft_disk_cache_find(font, glyph_index);
+	if (offset == 0) {
+		// only when another process appended to it
+		if (fstat(disk->fd, &st) == 0 &&
+			(size_t)st.st_size > disk->mapped) {
+			flock(disk->fd, LOCK_SH);
+			xcbft_disk_cache_sync();
+			flock(disk->fd, LOCK_UN);
+			offset = xcbft_disk_cache_find(font, glyph_index);
+		}
+		if (offset == 0) {
+			pthread_mutex_unlock(&disk->lock);
+			return NULL;
+		}
+	}
+
+	// the file is written by other processes, it is only trusted as far
+	// as the mapping goes and for bitmaps of the size of the glyph
+	if (offset + sizeof(record) > disk->mapped) {
+		pthread_mutex_unlock(&disk->lock);
+		return NULL;
+	}
+	memcpy(&record, disk->map + offset, sizeof(record));
+	if (!xcbft_disk_record_valid(&record, offset, disk->mapped) ||
+		record.glyph_index != glyph_index) {
+		pthread_mutex_unlock(&disk->lock);
+		return NULL;
+	}
+	raster = malloc(sizeof(struct xcbft_raster) + record.size);
+	memset(raster, 0, sizeof(struct xcbft_raster));
+	raster->data = (uint8_t *)(raster+1);
+	raster->size = record.size;
+	raster->font = raster_font;
+	raster->glyph_index = glyph_index;
+	raster->info = record.info;
+	memcpy(raster->data, disk->map + offset + sizeof(record), record.size);
+	pthread_mutex_unlock(&disk->lock);
+
+	return raster;
+}
+
+/*
+ * Keep the raster to append it to the file with the next flush.
+ */
+static void
+xcbft_disk_cache_put(uint64_t font, const struct xcbft_raster *raster)
+{
+	struct xcbft_disk_record record;
+	struct xcbft_disk_cache *disk = &xcbft_disk;
+
+	pthread_mutex_lock(&disk->lock);
+	if (disk->fd < 0) {
+		pthread_mutex_unlock(&disk->lock);
+		return;
+	}
+	if (disk->pending_length + sizeof(record) + raster->size >
+		disk->pending_allocated) {
+		disk->pending_allocated = disk->pending_allocated ?
+			disk->pending_allocated*2 : 16384;
+		if (disk->pending_length + sizeof(record) + raster->size >
+			disk->pending_allocated) {
+			disk->pending_allocated = disk->pending_length +
+				sizeof(record) + raster->size;
+		}
+		disk->pending = realloc(disk->pending,
+			disk->pending_allocated);
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.magic = XCBFT_DISK_CACHE_MAGIC;
+	record.glyph_index = raster->glyph_index;
+	record.font = font;
+	record.info = raster->info;
+	record.size = raster->size;
+	memcpy(disk->pending + disk->pending_length, &record, sizeof(record));
+	memcpy(disk->pending + disk->pending_length + sizeof(record),
+		raster->data, raster->size);
+	disk->pending_length += sizeof(record) + raster->size;
+	pthread_mutex_unlock(&disk->lock);
+}
+
+/*
+ * Append the pending rasters at the end of the valid records, with a
+ * single write under the exclusive lock. Nothing is added past the size
+ * limit of the file.
+ */
+static void
+xcbft_disk_cache_flush(void)
+{
+	size_t end;
+	struct xcbft_disk_cache *disk = &xcbft_disk;
+
+	pthread_mutex_lock(&disk->lock);
+	if (disk->fd < 0 || disk->pending_length == 0) {
+		pthread_mutex_unlock(&disk->lock);
+		return;
+	}
+
+	flock(disk->fd, LOCK_EX);
+	end = xcbft_disk_cache_sync();
+	if (end + disk->pending_length <= XCBFT_DISK_CACHE_LIMIT) {
+		// what a process that died left half written goes
+		if (ftruncate(disk->fd, end) != 0 ||
+			pwrite(disk->fd, disk->pending, disk->pending_length,
+			end) != (ssize_t)disk->pending_length) {
+			// the next sync stops at the broken record anyway
+			fprintf(stderr, "could not write the raster cache: %s\n",
+				strerror(errno));
+		}
+	}
+	flock(disk->fd, LOCK_UN);
+	disk->pending_length = 0;
+	pthread_mutex_unlock(&disk->lock);
+}
+
+/*
+ * Copy the rows of the 8 bits bitmap to the stride, zeroing the padding.
+ * A bitmap already at that stride is copied at once, the others row by
+ * row, 16 bytes at a time with SSE2.
+ */
+static void
+xcbft_repack_rows(uint8_t *data, size_t stride, const FT_Bitmap *bitmap)
+{
+	unsigned int x, y;
+	const uint8_t *row;
+	uint8_t *out;
+
+	if (bitmap->pitch > 0 && (size_t)bitmap->pitch == stride) {
+		memcpy(data, bitmap->buffer, stride*bitmap->rows);
+		return;
+	}
+
+	for (y = 0; y < bitmap->rows; y++) {
+		// the rows go up in memory when the pitch is negative
+		row = bitmap->buffer + (bitmap->pitch < 0 ?
+			(size_t)(bitmap->rows-1-y) * -bitmap->pitch :
+			(size_t)y * bitmap->pitch);
+		out = data + y*stride;
+		x = 0;
+#ifdef __SSE2__
+		for (; x+16 <= bitmap->width; x += 16) {
+			_mm_storeu_si128((__m128i *)(out+x),
+				_mm_loadu_si128((const __m128i *)(row+x)));
+		}
+#endif
+		memcpy(out+x, row+x, bitmap->width-x);
+		memset(out+bitmap->width, 0, stride-bitmap->width);
+	}
+}
+
+/*
+ * Expand the rows of the 1 bit bitmap to the stride, the pixels set being
+ * opaque in the a8 glyphset. 16 pixels at a time with SSE2.
+ */
+static void
+xcbft_expand_mono_rows(uint8_t *data, size_t stride,
+	const FT_Bitmap *bitmap)
+{
+	unsigned int x, y;
+	const uint8_t *row;
+	uint8_t *out;
+#ifdef __SSE2__
+	// the bit of each pixel, from the highest one
+	const __m128i bits = _mm_set_epi8(
+		1, 2, 4, 8, 16, 32, 64, (char)128,
+		1, 2, 4, 8, 16, 32, 64, (char)128);
+	__m128i pixels;
+#endif
+
+	for (y = 0; y < bitmap->rows; y++) {
+		row = bitmap->buffer + (bitmap->pitch < 0 ?
+			(size_t)(bitmap->rows-1-y) * -bitmap->pitch :
+			(size_t)y * bitmap->pitch);
+		out = data + y*stride;
+		x = 0;
+#ifdef __SSE2__
+		for (; x+16 <= bitmap->width; x += 16) {
+			pixels = _mm_set_epi8(
+				row[x/8+1], row[x/8+1], row[x/8+1], row[x/8+1],
+				row[x/8+1], row[x/8+1], row[x/8+1], row[x/8+1],
+				row[x/8], row[x/8], row[x/8], row[x/8],
+				row[x/8], row[x/8], row[x/8], row[x/8]);
+			pixels = _mm_cmpeq_epi8(_mm_and_si128(pixels, bits),
+				bits);
+			_mm_storeu_si128((__m128i *)(out+x), pixels);
+		}
+#endif
+		for (; x < bitmap->width; x++) {
+			out[x] = (row[x/8] >> (7-x%8)) & 1 ? 0xff : 0;
+		}
+		memset(out+bitmap->width, 0, stride-bitmap->width);
+	}
+}
+
+/*
+ * Drop the least recently used rasters until under the limit, the most
+ * recent one is always kept.
+ */
+static void
+xcbft_raster_cache_trim(void)
+{
+	unsigned int bucket;
+	struct xcbft_raster *oldest, **link;
+	struct xcbft_raster_cache *cache = &xcbft_rasters;
+
+	while (cache->stats.size > cache->limit &&
+		cache->oldest != cache->newest) {
+		oldest = cache->oldest;
+		bucket = xcbft_raster_bucket(oldest->font,
+			oldest->glyph_index, cache->buckets_length);
+		for (link = &cache->buckets[bucket]; *link != oldest;
+			link = &(*link)->next) {
+		}
+		*link = oldest->next;
+
+		cache->oldest = oldest->newer;
+		cache->oldest->older = NULL;
+		cache->stats.length--;
+		cache->stats.size -= sizeof(struct xcbft_raster) +
+			oldest->size;
+		cache->stats.evictions++;
+		free(oldest);
+	}
+}
+
+/*
+ * Keep at most that many bytes of rasterized glyphs for the process, the
+ * least recently used ones are dropped right away if over it.
+ */
+void
+xcbft_raster_cache_set_limit(size_t limit)
+{
+	pthread_mutex_lock(&xcbft_rasters.lock);
+	xcbft_rasters.limit = limit;
+	xcbft_raster_cache_trim();
+	pthread_mutex_unlock(&xcbft_rasters.lock);
+}
+
+/*
+ * How often the glyphs were found in the raster cache instead of being
+ * rasterized, and what it holds.
+ */
+struct xcbft_raster_cache_stats
+xcbft_raster_cache_stats(void)
+{
+	struct xcbft_raster_cache_stats stats;
+
+	pthread_mutex_lock(&xcbft_rasters.lock);
+	stats = xcbft_rasters.stats;
+	pthread_mutex_unlock(&xcbft_rasters.lock);
+
+	return stats;
+}
+
+static void
+xcbft_raster_cache_clear(void)
+{
+	unsigned int i;
+	struct xcbft_raster *raster, *older;
+	struct xcbft_raster_cache *cache = &xcbft_rasters;
+
+	pthread_mutex_lock(&cache->lock);
+	for (raster = cache->newest; raster != NULL; raster = older) {
+		older = raster->older;
+		free(raster);
+	}
+	for (i = 0; i < cache->fonts_length; i++) {
+		free(cache->fonts[i].file);
+	}
+	free(cache->fonts);
+	free(cache->buckets);
+	cache->fonts = NULL;
+	cache->fonts_length = 0;
+	cache->buckets = NULL;
+	cache->buckets_length = 0;
+	cache->newest = cache->oldest = NULL;
+	memset(&cache->stats, 0, sizeof(struct xcbft_raster_cache_stats));
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Send the glyphs staged for the glyphset in a single AddGlyphs request,
+ * the staging buffers are kept for the next batch.
+ */
+static void
+xcbft_glyph_batch_send(struct xcbft_glyph_cache *cache,
+	struct xcbft_glyphset *set)
+{
+	struct xcbft_glyph_batch *batch = &set->batch;
+
+	if (batch->length == 0) {
+		return;
+	}
+
+	xcb_render_add_glyphs(cache->c,
+		set->glyphset,
+		batch->length, batch->ids, batch->infos,
+		batch->data_length, batch->data);
+
+	batch->length = 0;
+	batch->data_length = 0;
+}
+
+static void
+xcbft_glyph_batch_destroy(struct xcbft_glyph_batch *batch)
+{
+	free(batch->ids);
+	free(batch->infos);
+	free(batch->data);
+	memset(batch, 0, sizeof(struct xcbft_glyph_batch));
+}
+
+/*
+ * Send all the staged glyphs of all the glyphsets.
+ * They are flushed along with the rest of the draw.
+ */
+void
+xcbft_glyph_cache_upload(struct xcbft_glyph_cache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->sets_length; i++) {
+		xcbft_glyph_batch_send(cache, &cache->sets[i]);
+	}
+	// along with what was rasterized for it
+	xcbft_disk_cache_flush();
+}
+
+/*
+ * Choose whether the draws flush the connection themselves or if the
+ * application takes care of it, once per frame for example.
+ */
+void
+xcbft_set_auto_flush(struct xcbft_context *ctx, bool auto_flush)
+{
+	ctx->auto_flush = auto_flush;
+}
+
+/*
+ * Have the errors given to a callback as soon as they are handled
+ * instead of queuing them, NULL to go back to the queue.
+ */
+void
+xcbft_set_error_handler(struct xcbft_context *ctx,
+	xcbft_error_handler_t handler, void *data)
+{
+	ctx->errors.handler = handler;
+	ctx->errors.handler_data = data;
+}
+
+/*
+ * To be called from the event loop of the application on the events with
+ * a response_type of 0.
+ * Returns true if the error comes from a render request, in which case it
+ * is given to the error handler or queued, false if it is not ours.
+ * The error isn't freed.
+ */
+bool
+xcbft_handle_error(struct xcbft_context *ctx, xcb_generic_error_t *error)
+{
+	struct xcbft_error_queue *queue = &ctx->errors;
+
+	if (error->response_type != 0 ||
+		error->major_code != ctx->render_opcode) {
+		return false;
+	}
+
+	if (queue->handler != NULL) {
+		queue->handler(error, queue->handler_data);
+		return true;
+	}
+
+	if (queue->length == XCBFT_ERROR_QUEUE_LENGTH) {
+		// keep the most recent ones
+		queue->first = (queue->first+1) % XCBFT_ERROR_QUEUE_LENGTH;
+		queue->length--;
+		queue->dropped++;
+	}
+	queue->errors[(queue->first+queue->length) % XCBFT_ERROR_QUEUE_LENGTH] =
+		*error;
+	queue->length++;
+
+	return true;
+}
+
+/*
+ * Take the oldest queued error, returns false when there are none left.
+ */
+bool
+xcbft_next_error(struct xcbft_context *ctx, xcb_generic_error_t *error)
+{
+	struct xcbft_error_queue *queue = &ctx->errors;
+
+	if (queue->length == 0) {
+		return false;
+	}
+
+	*error = queue->errors[queue->first];
+	queue->first = (queue->first+1) % XCBFT_ERROR_QUEUE_LENGTH;
+	queue->length--;
+
+	return true;
+}
+
+long
+xcbft_get_dpi(xcb_connection_t *c)
+{
+	long dpi;
+	xcb_xrm_database_t *xrm_db;
+
+	xrm_db = xcb_xrm_database_from_default(c);
+	if (xrm_db == NULL) {
+		fprintf(stderr,
+			"Could not open Xresources database falling back to highest dpi found\n");
+	}
+	dpi = xcbft_resources_dpi(c, xrm_db);
+	if (xrm_db != NULL) {
+		xcb_xrm_database_free(xrm_db);
+	}
+
+	return dpi;
+}
+
+/*
+ * The dpi from Xft.dpi, or from the screens when the database is NULL or
+ * doesn't have it.
+ */
+static long
+xcbft_resources_dpi(xcb_connection_t *c, xcb_xrm_database_t *xrm_db)
+{
+	int i;
+	long dpi;
+	long xres;
+	xcb_screen_iterator_t iter;
+
+	if (xrm_db != NULL) {
+		i = xcb_xrm_resource_get_long(xrm_db, "Xft.dpi", NULL, &dpi);
+		if (i < 0) {
+			fprintf(stderr,
+				"Could not fetch value of Xft.dpi from Xresources falling back to highest dpi found\n");
+		} else {
+			return dpi;
+		}
+	}
+
+	iter = xcb_setup_roots_iterator(xcb_get_setup(c));
+	dpi = 0;
+	for (; iter.rem; xcb_screen_next(&iter)) {
+		/*
+		* Inspired by xdpyinfo
+		*
+		* there are 2.54 centimeters to an inch; so
+		* there are 25.4 millimeters.
+		*
+		* dpi = N pixels / (M millimeters / (25.4 millimeters / 1 inch))
+		*     = N pixels / (M inch / 25.4)
+		*     = N * 25.4 pixels / M inch
+		*/
+		if (iter.data != NULL) {
+			xres = ((((double) iter.data->width_in_pixels) * 25.4) /
+				((double) iter.data->width_in_millimeters));
+
+			// ignore y resolution for now
+			//yres = ((((double) iter.data->height_in_pixels) * 25.4) /
+			//	((double) iter.data->height_in_millimeters));
+			if (xres > dpi) {
+				dpi = xres;
+			}
+		}
+	}
+
+	if (dpi == 0) {
+		// if everything fails use 96
+		fprintf(stderr,
+			"Could get highest dpi, using 96 as default\n");
+
+		dpi = 96;
+	}
+
+	return dpi;
+}
+
+/*
+ * Read the Xft.antialias, Xft.hinting, Xft.hintstyle and Xft.autohint
+ * resources into the settings, returning which of them were there.
+ */
+static unsigned int
+xcbft_resources_settings(xcb_xrm_database_t *xrm_db,
+	struct xcbft_render_settings *settings)
+{
+	unsigned int i, found = 0;
+	bool value;
+	long style;
+	char *name;
+	const char *styles[] = {
+		"hintnone", "hintslight", "hintmedium", "hintfull"
+	};
+
+	if (xcb_xrm_resource_get_bool(xrm_db, "Xft.antialias", NULL,
+		&value) == 0) {
+		settings->antialias = value;
+		found |= XCBFT_SETTING_ANTIALIAS;
+	}
+	if (xcb_xrm_resource_get_bool(xrm_db, "Xft.hinting", NULL,
+		&value) == 0) {
+		settings->hinting = value;
+		found |= XCBFT_SETTING_HINTING;
+	}
+	if (xcb_xrm_resource_get_bool(xrm_db, "Xft.autohint", NULL,
+		&value) == 0) {
+		settings->autohint = value;
+		found |= XCBFT_SETTING_AUTOHINT;
+	}
+	// by name as Xft writes them, or by number
+	if (xcb_xrm_resource_get_string(xrm_db, "Xft.hintstyle", NULL,
+		&name) == 0) {
+		for (i = 0; i < 4; i++) {
+			if (strcmp(name, styles[i]) == 0) {
+				settings->hint_style = FC_HINT_NONE + i;
+				found |= XCBFT_SETTING_HINT_STYLE;
+			}
+		}
+		free(name);
+		if (!(found & XCBFT_SETTING_HINT_STYLE) &&
+			xcb_xrm_resource_get_long(xrm_db, "Xft.hintstyle",
+			NULL, &style) == 0 &&
+			style >= FC_HINT_NONE && style <= FC_HINT_FULL) {
+			settings->hint_style = style;
+			found |= XCBFT_SETTING_HINT_STYLE;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Rasterize the faces loaded from now on with these settings, whatever the
+ * resources and the font patterns say.
+ * The font specs already matched are dropped so that they are loaded again
+ * with them.
+ */
+void
+xcbft_set_render_settings(struct xcbft_context *ctx,
+	struct xcbft_render_settings settings)
+{
+	ctx->settings = settings;
+	ctx->settings_forced = XCBFT_SETTING_ALL;
+	xcbft_spec_cache_clear(ctx);
+}
+
+/*
+ * The settings of a matched font, the ones of the context where the
+ * pattern doesn't say or where they are forced.
+ */
+static struct xcbft_render_settings
+xcbft_pattern_settings(struct xcbft_context *ctx, FcPattern *pattern)
+{
+	FcBool value;
+	int style;
+	struct xcbft_render_settings settings = ctx->settings;
+
+	if (!(ctx->settings_forced & XCBFT_SETTING_ANTIALIAS) &&
+		FcPatternGetBool(pattern, FC_ANTIALIAS, 0, &value) ==
+		FcResultMatch) {
+		settings.antialias = value;
+	}
+	if (!(ctx->settings_forced & XCBFT_SETTING_HINTING) &&
+		FcPatternGetBool(pattern, FC_HINTING, 0, &value) ==
+		FcResultMatch) {
+		settings.hinting = value;
+	}
+	if (!(ctx->settings_forced & XCBFT_SETTING_HINT_STYLE) &&
+		FcPatternGetInteger(pattern, FC_HINT_STYLE, 0, &style) ==
+		FcResultMatch) {
+		settings.hint_style = style;
+	}
+	if (!(ctx->settings_forced & XCBFT_SETTING_AUTOHINT) &&
+		FcPatternGetBool(pattern, FC_AUTOHINT, 0, &value) ==
+		FcResultMatch) {
+		settings.autohint = value;
 	}
 
-	faces.library = library;
-
-	return faces;
+	return settings;
 }
 
-FcStrSet*
-xcbft_extract_fontsearch_list(char *string)
+/*
+ * Give the pattern our default hint style if the configuration didn't set
+ * one, before FcDefaultSubstitute puts the full hinting there.
+ * The rules of the configuration that target the fonts still apply on top
+ * of it when matching.
+ */
+static void
+xcbft_pattern_default_hint_style(FcPattern *pattern)
 {
-	FcStrSet *fontsearch = NULL;
-	FcChar8 *fontquery;
-	FcBool result = FcFalse;
-	char *r = strdup(string);
-	char *p_to_r = r;
-	char *token = NULL;
+	int style;
 
-	fontsearch = FcStrSetCreate();
+	if (FcPatternGetInteger(pattern, FC_HINT_STYLE, 0, &style) !=
+		FcResultMatch) {
+		FcPatternAddInteger(pattern, FC_HINT_STYLE,
+			XCBFT_DEFAULT_HINT_STYLE);
+	}
+}
 
-	token = strtok(r, ",");
-	while (token != NULL) {
-		fontquery = (FcChar8*)token;
-		result = FcStrSetAdd(fontsearch, fontquery);
-		if (result == FcFalse) {
-			fprintf(stderr,
-				"Couldn't add fontquery to fontsearch set");
-		}
-		token = strtok(NULL, ",");
+/*
+ * The FreeType load flags for the settings at that pixel size.
+ */
+static FT_Int32
+xcbft_load_flags(struct xcbft_render_settings settings, double pixel_size)
+{
+	FT_Int32 flags = FT_LOAD_RENDER;
+
+	if (!settings.hinting || settings.hint_style == FC_HINT_NONE ||
+		(settings.unhinted_size > 0 &&
+		pixel_size >= settings.unhinted_size)) {
+		flags |= FT_LOAD_NO_HINTING;
+	} else if (settings.autohint) {
+		flags |= FT_LOAD_FORCE_AUTOHINT;
 	}
 
-	free(p_to_r);
+	if (!settings.antialias) {
+		flags |= FT_LOAD_MONOCHROME | FT_LOAD_TARGET_MONO;
+	} else if (settings.hint_style == FC_HINT_SLIGHT) {
+		flags |= FT_LOAD_TARGET_LIGHT;
+	} else {
+		flags |= FT_LOAD_TARGET_NORMAL;
+	}
 
-	return fontsearch;
+	return flags;
 }
 
+/*
+ * Rasterize the glyphs missing from the draws on that many threads, each
+ * with its own FreeType library and faces, 0 to stop them.
+ * The thread of the connection still uploads the glyphs, the workers only
+ * take over when a draw needs enough new glyphs, a page of CJK text seen
+ * for the first time for example.
+ * Returns false if the threads couldn't be started.
+ */
+bool
+xcbft_set_workers(struct xcbft_context *ctx, unsigned int length)
+{
+	unsigned int i;
+	struct xcbft_worker_pool *pool;
 
+	if (ctx->workers != NULL) {
+		xcbft_prewarm_collect(ctx);
+		xcbft_worker_pool_stop(ctx->workers);
+		ctx->workers = NULL;
+	}
+	if (length == 0) {
+		return true;
+	}
 
-void
-xcbft_patterns_holder_destroy(struct xcbft_patterns_holder patterns)
-{
-	int i = 0;
+	pool = calloc(1, sizeof(struct xcbft_worker_pool));
+	pool->workers = calloc(length, sizeof(struct xcbft_worker));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
 
-	for (; i < patterns.length; i++) {
-		FcPatternDestroy(patterns.patterns[i]);
+	for (i = 0; i < length; i++) {
+		pool->workers[i].pool = pool;
+		if (FT_Init_FreeType(&pool->workers[i].library) != FT_Err_Ok) {
+			fprintf(stderr, "could not initialize freetype\n");
+			break;
+		}
+		if (pthread_create(&pool->workers[i].thread, NULL,
+			xcbft_worker_run, &pool->workers[i]) != 0) {
+			fprintf(stderr, "could not start a worker\n");
+			FT_Done_FreeType(pool->workers[i].library);
+			break;
+		}
+		pool->length++;
 	}
-	free(patterns.patterns);
-	// FcFini(); // TODO: we can't leave that here, find a way for cleanup
+	if (pool->length == 0) {
+		xcbft_worker_pool_stop(pool);
+		return false;
+	}
+
+	ctx->workers = pool;
+	return true;
 }
 
-void
-xcbft_face_holder_destroy(struct xcbft_face_holder faces)
+static void
+xcbft_worker_pool_stop(struct xcbft_worker_pool *pool)
 {
-	int i = 0;
+	unsigned int i, j;
+	struct xcbft_worker *worker;
 
-	for (; i < faces.length; i++) {
-		FT_Done_Face(faces.faces[i]);
-	}
-	if (faces.faces) {
-		free(faces.faces);
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->length; i++) {
+		worker = &pool->workers[i];
+		pthread_join(worker->thread, NULL);
+		// the faces and their sizes go with the library
+		FT_Done_FreeType(worker->library);
+		for (j = 0; j < worker->faces_length; j++) {
+			xcbft_font_file_release(worker->faces[j].file);
+		}
+		free(worker->faces);
+		free(worker->fonts);
 	}
-	FT_Done_FreeType(faces.library);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
 }
 
-FT_Vector
-xcbft_draw_text(
-	xcb_connection_t *c, // conn
-	xcb_drawable_t pmap, // win or pixmap
-	int16_t x, int16_t y, // x, y
-	struct utf_holder text, // text
-	xcb_render_color_t color,
-	struct xcbft_face_holder faces,
-	long dpi)
+static void *
+xcbft_worker_run(void *data)
 {
-	xcb_void_cookie_t cookie;
-	uint32_t values[2];
-	xcb_generic_error_t *error;
-	xcb_render_picture_t picture;
-	xcb_render_pictforminfo_t *fmt;
-	const xcb_render_query_pict_formats_reply_t *fmt_rep =
-		xcb_render_util_query_formats(c);
+	struct xcbft_worker *worker = data;
+	struct xcbft_worker_pool *pool = worker->pool;
+	struct xcbft_raster_job *job;
 
-	fmt = xcb_render_util_find_standard_format(
-		fmt_rep,
-		XCB_PICT_STANDARD_RGB_24
-	);
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && pool->next_job >= pool->jobs_length) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		if (pool->quit) {
+			break;
+		}
+		job = &pool->jobs[pool->next_job];
+		pool->next_job++;
+		pthread_mutex_unlock(&pool->lock);
 
-	// create the picture with its attribute and format
-	picture = xcb_generate_id(c);
-	values[0] = XCB_RENDER_POLY_MODE_IMPRECISE;
-	values[1] = XCB_RENDER_POLY_EDGE_SMOOTH;
-	cookie = xcb_render_create_picture_checked(c,
-		picture, // pid
-		pmap, // drawable from the user
-		fmt->id, // format
-		XCB_RENDER_CP_POLY_MODE|XCB_RENDER_CP_POLY_EDGE,
-		values); // make it smooth
+		xcbft_worker_rasterize(worker, job);
 
-	error = xcb_request_check(c, cookie);
-	if (error) {
-		fprintf(stderr, "ERROR: %s : %d\n",
-			"could not create picture",
-			error->error_code);
+		pthread_mutex_lock(&pool->lock);
+		pool->pending--;
+		if (pool->pending == 0) {
+			pthread_cond_signal(&pool->done);
+		}
 	}
+	pthread_mutex_unlock(&pool->lock);
 
-	// create a 1x1 pixel pen (on repeat mode) of a certain color
-	xcb_render_picture_t fg_pen = xcbft_create_pen(c, color);
-
-	// load all the glyphs in a glyphset
-	// TODO: maybe cache the xcb_render_glyphset_t
-	struct xcbft_glyphset_and_advance glyphset_advance =
-		xcbft_load_glyphset(c, faces, text, dpi);
-
-	// we now have a text stream - a bunch of glyphs basically
-	xcb_render_util_composite_text_stream_t *ts =
-		xcb_render_util_composite_text_stream(
-				glyphset_advance.glyphset,
-				text.length, 0);
+	return NULL;
+}
 
-	// draw the text at a certain positions
-	xcb_render_util_glyphs_32(ts, x, y, text.length, text.str);
+/*
+ * Rasterize the glyph of the job with the faces of the worker, opened and
+ * sized as the fonts of the context the first time.
+ */
+static void
+xcbft_worker_rasterize(struct xcbft_worker *worker,
+	struct xcbft_raster_job *job)
+{
+	unsigned int i;
+	FT_Face face = NULL;
+	struct xcbft_font_file *mapping;
+	struct xcbft_worker_font *font = NULL;
 
-	// finally render using the repeated pen color on the picture
-	// (which is related to the pixmap)
-	xcb_render_util_composite_text(
-		c, // connection
-		XCB_RENDER_PICT_OP_OVER, //op
-		fg_pen, // src
-		picture, // dst
-		0, // fmt
-		0, // src x
-		0, // src y
-		ts); // txt stream
+	for (i = 0; i < worker->faces_length; i++) {
+		if (worker->faces[i].index == job->index &&
+			strcmp(worker->faces[i].file->path, job->file) == 0) {
+			face = worker->faces[i].face;
+			break;
+		}
+	}
+	if (face == NULL) {
+		// on the mapping of the context, which the face keeps
+		if (xcbft_face_open(worker->library, job->file, job->index,
+			&face, &mapping) != FT_Err_Ok) {
+			return;
+		}
+		worker->faces = realloc(worker->faces,
+			sizeof(struct xcbft_worker_face) *
+			(worker->faces_length+1));
+		worker->faces[worker->faces_length].file = mapping;
+		worker->faces[worker->faces_length].index = job->index;
+		worker->faces[worker->faces_length].face = face;
+		worker->faces_length++;
+	}
 
-	xcb_render_util_composite_text_free(ts);
-	xcb_render_free_picture(c, picture);
-	xcb_render_free_picture(c, fg_pen);
-	xcb_render_util_disconnect(c);
+	for (i = 0; i < worker->fonts_length; i++) {
+		if (worker->fonts[i].face == face &&
+			worker->fonts[i].char_size == job->char_size &&
+			worker->fonts[i].dpi == job->dpi) {
+			font = &worker->fonts[i];
+			break;
+		}
+	}
+	if (font == NULL) {
+		worker->fonts = realloc(worker->fonts,
+			sizeof(struct xcbft_worker_font) *
+			(worker->fonts_length+1));
+		font = &worker->fonts[worker->fonts_length];
+		font->face = face;
+		font->char_size = job->char_size;
+		font->dpi = job->dpi;
+		if (FT_New_Size(face, &font->size) != FT_Err_Ok) {
+			return;
+		}
+		FT_Activate_Size(font->size);
+		if (FT_Set_Char_Size(face, 0, job->char_size, job->dpi,
+			job->dpi) != FT_Err_Ok) {
+			FT_Done_Size(font->size);
+			return;
+		}
+		worker->fonts_length++;
+	}
 
-	return glyphset_advance.advance;
+	FT_Activate_Size(font->size);
+	FT_Set_Transform(face, job->has_matrix ? &job->matrix : NULL, NULL);
+	FT_Load_Glyph(face, job->glyph_index, job->load_flags);
+	job->raster = xcbft_raster_new(face->glyph, job->raster_font,
+		job->glyph_index);
 }
 
-xcb_render_picture_t
-xcbft_create_pen(xcb_connection_t *c, xcb_render_color_t color)
+/*
+ * Fill the jobs for the glyphs of the fonts that are neither uploaded nor
+ * in the raster cache, once each, returning how many there are.
+ * There is room for as many jobs as glyphs.
+ */
+static unsigned int
+xcbft_raster_jobs(struct xcbft_context *ctx, struct xcbft_font **fonts,
+	const uint32_t *glyph_indexes, unsigned int length,
+	struct xcbft_raster_job *jobs)
 {
-	xcb_render_pictforminfo_t *fmt;
-	const xcb_render_query_pict_formats_reply_t *fmt_rep =
-		xcb_render_util_query_formats(c);
-	// alpha can only be used with a picture containing a pixmap
-	fmt = xcb_render_util_find_standard_format(
-		fmt_rep,
-		XCB_PICT_STANDARD_ARGB_32
-	);
+	unsigned int i, j, k, jobs_length = 0, seen_length;
+	// job + 1 by (raster font, glyph index), open addressing
+	unsigned int *seen;
+	struct xcbft_font_glyphs *entry;
+	struct xcbft_raster_job *job;
+	struct xcbft_raster *raster;
 
-	xcb_drawable_t root = xcb_setup_roots_iterator(
-			xcb_get_setup(c)
-		).data->root;
+	for (seen_length = 64; seen_length < length*2; seen_length *= 2) {
+	}
+	seen = calloc(seen_length, sizeof(unsigned int));
 
-	xcb_pixmap_t pm = xcb_generate_id(c);
-	xcb_create_pixmap(c, 32, pm, root, 1, 1);
+	for (i = 0; i < length; i++) {
+		entry = xcbft_glyph_cache_get_font(ctx->glyph_cache, fonts[i],
+			fonts[i]->load_flags);
+		if (xcbft_glyph_table_get(&entry->glyphs,
+			glyph_indexes[i]) != NULL) {
+			continue;
+		}
+		pthread_mutex_lock(&xcbft_rasters.lock);
+		raster = xcbft_raster_find(entry->raster_font,
+			glyph_indexes[i]);
+		pthread_mutex_unlock(&xcbft_rasters.lock);
+		if (raster != NULL) {
+			continue;
+		}
+		// nothing to rasterize when another process already did
+		raster = xcbft_disk_cache_get(entry->disk_key,
+			entry->raster_font, glyph_indexes[i]);
+		if (raster != NULL) {
+			pthread_mutex_lock(&xcbft_rasters.lock);
+			xcbft_rasters.stats.disk_hits++;
+			raster->counted = true;
+			xcbft_raster_insert(raster);
+			pthread_mutex_unlock(&xcbft_rasters.lock);
+			continue;
+		}
+		j = xcbft_raster_bucket(entry->raster_font, glyph_indexes[i],
+			seen_length);
+		for (; seen[j] != 0; j = (j+1) & (seen_length-1)) {
+			k = seen[j]-1;
+			if (jobs[k].raster_font == entry->raster_font &&
+				jobs[k].glyph_index == glyph_indexes[i]) {
+				break;
+			}
+		}
+		if (seen[j] != 0) {
+			continue;
+		}
+		seen[j] = jobs_length+1;
 
-	uint32_t values[1];
-	values[0] = XCB_RENDER_REPEAT_NORMAL;
-
-	xcb_render_picture_t picture = xcb_generate_id(c);
-
-	xcb_render_create_picture(c,
-		picture,
-		pm,
-		fmt->id,
-		XCB_RENDER_CP_REPEAT,
-		values);
-
-	xcb_rectangle_t rect = {
-		.x = 0,
-		.y = 0,
-		.width = 1,
-		.height = 1
-	};
+		job = &jobs[jobs_length];
+		job->file = fonts[i]->entry->file;
+		job->index = fonts[i]->entry->index;
+		job->char_size = fonts[i]->char_size;
+		job->dpi = ctx->dpi;
+		job->has_matrix = fonts[i]->has_matrix;
+		job->matrix = fonts[i]->matrix;
+		job->load_flags = entry->load_flags;
+		job->raster_font = entry->raster_font;
+		job->disk_key = entry->disk_key;
+		job->glyph_index = glyph_indexes[i];
+		job->raster = NULL;
+		job->font = fonts[i];
+		jobs_length++;
+	}
 
-	xcb_render_fill_rectangles(c,
-		XCB_RENDER_PICT_OP_OVER,
-		picture,
-		color, 1, &rect);
+	free(seen);
+	return jobs_length;
+}
 
-	xcb_free_pixmap(c, pm);
-	return picture;
+/*
+ * Give the jobs to the workers, they own them until waited for.
+ */
+static void
+xcbft_workers_start(struct xcbft_worker_pool *pool,
+	struct xcbft_raster_job *jobs, unsigned int length, bool background)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->jobs = jobs;
+	pool->jobs_length = length;
+	pool->next_job = 0;
+	pool->pending = length;
+	pool->background = background;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
 }
 
-struct xcbft_glyphset_and_advance
-xcbft_load_glyphset(
-	xcb_connection_t *c,
-	struct xcbft_face_holder faces,
-	struct utf_holder text,
-	long dpi)
+static void
+xcbft_workers_wait(struct xcbft_worker_pool *pool)
 {
-	unsigned int i, j;
-	int glyph_index;
-	xcb_render_glyphset_t gs;
-	xcb_render_pictforminfo_t *fmt_a8;
-	struct xcbft_face_holder faces_for_unsupported;
-	const xcb_render_query_pict_formats_reply_t *fmt_rep =
-		xcb_render_util_query_formats(c);
-	FT_Vector total_advance, glyph_advance;
-	struct xcbft_glyphset_and_advance glyphset_advance;
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pool->jobs = NULL;
+	pool->jobs_length = pool->next_job = 0;
+	pool->background = false;
+	pthread_mutex_unlock(&pool->lock);
+}
 
-	total_advance.x = total_advance.y = 0;
-	glyph_index = 0;
-	faces_for_unsupported.length = 0;
-	// create a glyphset with a specific format
-	fmt_a8 = xcb_render_util_find_standard_format(
-		fmt_rep,
-		XCB_PICT_STANDARD_A_8
-	);
-	gs = xcb_generate_id(c);
-	xcb_render_create_glyph_set(c, gs, fmt_a8->id);
+/*
+ * Rasterize the glyphs of the fonts that are neither uploaded nor in the
+ * raster cache on the workers, when there are enough of them, and put
+ * them in the raster cache for the upload.
+ */
+static void
+xcbft_rasterize_parallel(struct xcbft_context *ctx,
+	struct xcbft_font **fonts, const uint32_t *glyph_indexes,
+	unsigned int length)
+{
+	unsigned int i, jobs_length;
+	struct xcbft_raster_job *jobs;
 
-	for (i = 0; i < text.length; i++) {
-		for (j = 0; j < faces.length; j++) {
-			glyph_index = FT_Get_Char_Index(
-				faces.faces[j],
-				text.str[i]);
-			if (glyph_index != 0) break;
-		}
-		// here use face at index j
-		if (glyph_index != 0) {
-			glyph_advance = xcbft_load_glyph(c, gs, faces.faces[j], text.str[i]);
-			total_advance.x += glyph_advance.x;
-			total_advance.y += glyph_advance.y;
-		} else {
-			// fallback
-			// TODO pass at least some of the query (font size, italic, etc..)
-
-			glyph_index = 0;
-			// check if we already loaded that face as fallback
-			if (faces_for_unsupported.length > 0) {
-				glyph_index = FT_Get_Char_Index(
-					faces_for_unsupported.faces[0],
-					text.str[i]);
-			}
-			if (glyph_index == 0) {
-				if (faces_for_unsupported.length > 0) {
-					xcbft_face_holder_destroy(faces_for_unsupported);
-				}
-				faces_for_unsupported = xcbft_query_by_char_support(
-					text.str[i],
-					NULL, dpi);
-			}
-			if (faces_for_unsupported.length == 0) {
-				fprintf(stderr,
-					"No faces found supporting character: %02x\n",
-					text.str[i]);
-				// draw a block using whatever font
-				glyph_advance = xcbft_load_glyph(c, gs, faces.faces[0], text.str[i]);
-				total_advance.x += glyph_advance.x;
-				total_advance.y += glyph_advance.y;
-			} else {
-				FT_Set_Char_Size(
-						faces_for_unsupported.faces[0],
-						0, (faces.faces[0]->size->metrics.x_ppem/((double)dpi/72.0))*64,
-						dpi, dpi);
+	if (length < XCBFT_PARALLEL_GLYPHS) {
+		return;
+	}
 
-				glyph_advance = xcbft_load_glyph(c, gs,
-					faces_for_unsupported.faces[0],
-					text.str[i]);
-				total_advance.x += glyph_advance.x;
-				total_advance.y += glyph_advance.y;
+	jobs = malloc(sizeof(struct xcbft_raster_job)*length);
+	jobs_length = xcbft_raster_jobs(ctx, fonts, glyph_indexes, length,
+		jobs);
+	if (jobs_length >= XCBFT_PARALLEL_GLYPHS) {
+		xcbft_workers_start(ctx->workers, jobs, jobs_length, false);
+		xcbft_workers_wait(ctx->workers);
+
+		// the ones that failed are rasterized when uploaded
+		for (i = 0; i < jobs_length; i++) {
+			if (jobs[i].raster != NULL) {
+				xcbft_disk_cache_put(jobs[i].disk_key,
+					jobs[i].raster);
 			}
 		}
-	}
-	if (faces_for_unsupported.length > 0) {
-		xcbft_face_holder_destroy(faces_for_unsupported);
+		pthread_mutex_lock(&xcbft_rasters.lock);
+		for (i = 0; i < jobs_length; i++) {
+			if (jobs[i].raster != NULL) {
+				xcbft_rasters.stats.misses++;
+				jobs[i].raster->counted = true;
+				xcbft_raster_insert(jobs[i].raster);
+			}
+		}
+		pthread_mutex_unlock(&xcbft_rasters.lock);
 	}
 
-	glyphset_advance.advance = total_advance;
-	glyphset_advance.glyphset = gs;
-	return glyphset_advance;
+	free(jobs);
 }
 
-FT_Vector
-xcbft_load_glyph(
-	xcb_connection_t *c, xcb_render_glyphset_t gs, FT_Face face, int charcode)
+/*
+ * Rasterize and upload the glyphs of the codepoints in the ranges that the
+ * faces have, before they are drawn.
+ * With workers it is done in the background, the glyphs are uploaded by
+ * the next draw, which waits for them if they aren't all there yet.
+ * Otherwise it is done right away.
+ */
+void
+xcbft_prewarm(struct xcbft_context *ctx, struct xcbft_face_holder faces,
+	const struct xcbft_codepoint_range *ranges, unsigned int length)
 {
-	uint32_t gid;
-	int glyph_index;
-	FT_Vector glyph_advance;
-	xcb_render_glyphinfo_t ginfo;
-	FT_Bitmap *bitmap;
-
-	FT_Select_Charmap(face, ft_encoding_unicode);
-	glyph_index = FT_Get_Char_Index(face, charcode);
-
-	FT_Load_Glyph(face, glyph_index, FT_LOAD_RENDER | FT_LOAD_FORCE_AUTOHINT);
+	unsigned int i, j, jobs_length;
+	size_t count = 0;
+	bool cached;
+	uint32_t codepoint, last, glyph_index, *glyph_indexes;
+	struct xcbft_font **fonts;
+	struct xcbft_font_glyphs *entry;
+	struct xcbft_raster_job *jobs;
 
-	bitmap = &face->glyph->bitmap;
+	// nothing past unicode is looked up
+	for (i = 0; i < length; i++) {
+		last = XCBFT_MIN(ranges[i].last, 0x10FFFF);
+		if (last >= ranges[i].first) {
+			count += (size_t)(last - ranges[i].first) + 1;
+		}
+	}
+	fonts = malloc(sizeof(struct xcbft_font *)*(count ? count : 1));
+	glyph_indexes = malloc(sizeof(uint32_t)*(count ? count : 1));
 
-	ginfo.x = -face->glyph->bitmap_left;
-	ginfo.y = face->glyph->bitmap_top;
-	ginfo.width = bitmap->width;
-	ginfo.height = bitmap->rows;
-	glyph_advance.x = face->glyph->advance.x/64;
-	glyph_advance.y = face->glyph->advance.y/64;
-	ginfo.x_off = glyph_advance.x;
-	ginfo.y_off = glyph_advance.y;
+	// only what the faces have, no fallbacks for the codepoints nothing
+	// has in the ranges
+	count = 0;
+	for (i = 0; i < length; i++) {
+		last = XCBFT_MIN(ranges[i].last, 0x10FFFF);
+		for (codepoint = ranges[i].first; codepoint <= last;
+			codepoint++) {
+			for (j = 0; j < faces.length; j++) {
+				glyph_index = xcbft_holder_char_index(ctx,
+					faces, j, codepoint);
+				if (glyph_index != 0) {
+					fonts[count] = faces.faces[j];
+					glyph_indexes[count] = glyph_index;
+					count++;
+					break;
+				}
+			}
+		}
+	}
 
-	// keep track of the max horiBearingY (yMax) and yMin
-	// 26.6 fractional pixel format
-	// yMax = face->glyph->metrics.horiBearingY/64; (yMax);
-	// yMin = -(face->glyph->metrics.height -
-	//		face->glyph->metrics.horiBearingY)/64;
+	if (ctx->workers != NULL) {
+		// one batch in the background at a time
+		xcbft_prewarm_collect(ctx);
+		jobs = malloc(sizeof(struct xcbft_raster_job)*(count ? count : 1));
+		jobs_length = xcbft_raster_jobs(ctx, fonts, glyph_indexes,
+			count, jobs);
+		for (i = 0; i < jobs_length; i++) {
+			jobs[i].font->refcount++;
+		}
+		if (jobs_length > 0) {
+			xcbft_workers_start(ctx->workers, jobs, jobs_length,
+				true);
+		} else {
+			free(jobs);
+		}
 
-	gid = charcode;
+		// the ones in the raster cache have no job but still have to
+		// be uploaded for this context
+		for (i = 0; i < count; i++) {
+			entry = xcbft_glyph_cache_get_font(ctx->glyph_cache,
+				fonts[i], fonts[i]->load_flags);
+			if (xcbft_glyph_table_get(&entry->glyphs,
+				glyph_indexes[i]) != NULL) {
+				continue;
+			}
+			pthread_mutex_lock(&xcbft_rasters.lock);
+			cached = xcbft_raster_find(entry->raster_font,
+				glyph_indexes[i]) != NULL;
+			pthread_mutex_unlock(&xcbft_rasters.lock);
+			if (cached) {
+				xcbft_load_glyph(ctx->glyph_cache, entry,
+					glyph_indexes[i]);
+			}
+		}
+	} else {
+		for (i = 0; i < count; i++) {
+			entry = xcbft_glyph_cache_get_font(ctx->glyph_cache,
+				fonts[i], fonts[i]->load_flags);
+			xcbft_load_glyph(ctx->glyph_cache, entry,
+				glyph_indexes[i]);
+		}
+	}
+	xcbft_glyph_cache_upload(ctx->glyph_cache);
+	if (ctx->auto_flush) {
+		xcb_flush(ctx->c);
+	}
 
-	int stride = (ginfo.width+3)&~3;
-	uint8_t *tmpbitmap = calloc(sizeof(uint8_t),stride*ginfo.height);
-	int y;
+	free(fonts);
+	free(glyph_indexes);
+}
 
-	for (y = 0; y < ginfo.height; y++)
-		memcpy(tmpbitmap+y*stride, bitmap->buffer+y*ginfo.width, ginfo.width);
+/*
+ * Wait for the glyphs being prewarmed in the background, if any, and
+ * upload them.
+ */
+static void
+xcbft_prewarm_collect(struct xcbft_context *ctx)
+{
+	unsigned int i, length;
+	struct xcbft_raster_job *jobs;
+	struct xcbft_font_glyphs *entry;
+	struct xcbft_worker_pool *pool = ctx->workers;
 
-	xcb_render_add_glyphs_checked(c,
-		gs, 1, &gid, &ginfo, stride*ginfo.height, tmpbitmap);
+	if (pool == NULL || !pool->background) {
+		return;
+	}
+	jobs = pool->jobs;
+	length = pool->jobs_length;
+	xcbft_workers_wait(pool);
 
-	free(tmpbitmap);
+	for (i = 0; i < length; i++) {
+		if (jobs[i].raster != NULL) {
+			xcbft_disk_cache_put(jobs[i].disk_key,
+				jobs[i].raster);
+			pthread_mutex_lock(&xcbft_rasters.lock);
+			xcbft_rasters.stats.misses++;
+			jobs[i].raster->counted = true;
+			xcbft_raster_insert(jobs[i].raster);
+			pthread_mutex_unlock(&xcbft_rasters.lock);
+		}
+		entry = xcbft_glyph_cache_get_font(ctx->glyph_cache,
+			jobs[i].font, jobs[i].load_flags);
+		xcbft_load_glyph(ctx->glyph_cache, entry,
+			jobs[i].glyph_index);
+		xcbft_font_release(ctx, jobs[i].font);
+	}
+	xcbft_glyph_cache_upload(ctx->glyph_cache);
+	free(jobs);
+}
 
-	xcb_flush(c);
-	return glyph_advance;
+/*
+ * Start or stop recording the codepoints drawn, to save them with
+ * xcbft_save_usage and prewarm them the next time.
+ */
+void
+xcbft_record_usage(struct xcbft_context *ctx, bool record)
+{
+	if (record && ctx->usage == NULL) {
+		ctx->usage = calloc(0x110000/8, 1);
+	} else if (!record) {
+		free(ctx->usage);
+		ctx->usage = NULL;
+	}
 }
 
-long
-xcbft_get_dpi(xcb_connection_t *c)
+/*
+ * Write the codepoints drawn since the recording started to the file, as
+ * ranges in hexadecimal, one per line.
+ * Returns false if not recording or if the file couldn't be written.
+ */
+bool
+xcbft_save_usage(struct xcbft_context *ctx, const char *path)
 {
-	int i;
-	long dpi;
-	long xres;
-	xcb_xrm_database_t *xrm_db;
-	xcb_screen_iterator_t iter;
+	uint32_t codepoint, first;
+	bool used, in_range = false;
+	FILE *file;
 
-	xrm_db = xcb_xrm_database_from_default(c);
-	if (xrm_db != NULL) {
-		i = xcb_xrm_resource_get_long(xrm_db, "Xft.dpi", NULL, &dpi);
-		xcb_xrm_database_free(xrm_db);
-		if (i < 0) {
-			fprintf(stderr,
-				"Could not fetch value of Xft.dpi from Xresources falling back to highest dpi found\n");
-		} else {
-			return dpi;
-		}
-	} else {
-		fprintf(stderr,
-			"Could not open Xresources database falling back to highest dpi found\n");
+	if (ctx->usage == NULL) {
+		return false;
+	}
+	file = fopen(path, "w");
+	if (file == NULL) {
+		fprintf(stderr, "could not write %s: %s\n", path,
+			strerror(errno));
+		return false;
 	}
 
-	iter = xcb_setup_roots_iterator(xcb_get_setup(c));
-	dpi = 0;
-	for (; iter.rem; xcb_screen_next(&iter)) {
-		/*
-		* Inspired by xdpyinfo
-		*
-		* there are 2.54 centimeters to an inch; so
-		* there are 25.4 millimeters.
-		*
-		* dpi = N pixels / (M millimeters / (25.4 millimeters / 1 inch))
-		*     = N pixels / (M inch / 25.4)
-		*     = N * 25.4 pixels / M inch
-		*/
-		if (iter.data != NULL) {
-			xres = ((((double) iter.data->width_in_pixels) * 25.4) /
-				((double) iter.data->width_in_millimeters));
-
-			// ignore y resolution for now
-			//yres = ((((double) iter.data->height_in_pixels) * 25.4) /
-			//	((double) iter.data->height_in_millimeters));
-			if (xres > dpi) {
-				dpi = xres;
+	first = 0;
+	for (codepoint = 0; codepoint <= 0x110000; codepoint++) {
+		used = codepoint < 0x110000 &&
+			ctx->usage[codepoint >> 3] & (1 << (codepoint & 7));
+		if (used && !in_range) {
+			first = codepoint;
+			in_range = true;
+		} else if (!used && in_range) {
+			if (first == codepoint-1) {
+				fprintf(file, "%04X\n", first);
+			} else {
+				fprintf(file, "%04X-%04X\n", first,
+					codepoint-1);
 			}
+			in_range = false;
 		}
 	}
 
-	if (dpi == 0) {
-		// if everything fails use 96
-		fprintf(stderr,
-			"Could get highest dpi, using 96 as default\n");
+	if (fclose(file) != 0) {
+		fprintf(stderr, "could not write %s: %s\n", path,
+			strerror(errno));
+		return false;
+	}
+	return true;
+}
 
-		dpi = 96;
+/*
+ * Read the ranges saved by xcbft_save_usage, to give to xcbft_prewarm.
+ * Returns how many there are, the ranges are to be freed.
+ */
+unsigned int
+xcbft_load_usage(const char *path, struct xcbft_codepoint_range **ranges)
+{
+	unsigned int length = 0, allocated = 0;
+	unsigned long first, last;
+	char line[64];
+	int fields;
+	FILE *file;
+
+	*ranges = NULL;
+	file = fopen(path, "r");
+	if (file == NULL) {
+		// nothing saved yet
+		return 0;
 	}
 
-	return dpi;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		fields = sscanf(line, "%lx-%lx", &first, &last);
+		if (fields < 1) {
+			continue;
+		}
+		if (fields == 1) {
+			last = first;
+		}
+		// not a file saved by xcbft_save_usage
+		if (first > 0x10FFFF || last > 0x10FFFF) {
+			continue;
+		}
+		if (length + 1 > allocated) {
+			allocated = allocated ? allocated*2 : 64;
+			*ranges = realloc(*ranges,
+				sizeof(struct xcbft_codepoint_range)*allocated);
+		}
+		(*ranges)[length].first = first;
+		(*ranges)[length].last = last;
+		length++;
+	}
+	fclose(file);
+
+	return length;
 }
 
 #endif // _XCBFT